@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
 #include "common.h"
 #include "protocol.h"
 #include <ctype.h>
 #include <ncurses.h>
+#include <netdb.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 SOCKET g_socket = INVALID_SOCKET;
 int g_running = 1;
+int g_session_open = 1;
 ConfigMsg g_config;
 int g_view_mode = 0;
 
@@ -13,10 +17,26 @@ CellStats g_stats_cache[MAX_GRID_SIZE][MAX_GRID_SIZE];
 int g_stats_repl_done = 0;
 int g_stats_repl_total = 0;
 
+int g_cursor_x = 0;
+int g_cursor_y = 0;
+HistogramMsg g_histogram;
+int g_has_histogram = 0;
+
+int g_zoom = 0;
+int g_view_x = 0;
+int g_view_y = 0;
+
+int g_prompting = 0;
+char g_status_msg[512] = "";
+
+SharedStats *g_shared_stats = NULL;
+unsigned int g_shared_seq = 0;
+
 void reset_stats_cache() {
   memset(g_stats_cache, 0, sizeof(g_stats_cache));
   g_stats_repl_done = 0;
   g_stats_repl_total = 0;
+  g_has_histogram = 0;
 }
 
 void draw_text_centered(int y, char *text) {
@@ -61,8 +81,18 @@ void configure_simulation_ui() {
 
   g_config.use_obstacles =
       get_input_int(14, 2, "Use Obstacles? (0=No, 1=Random)");
-  get_input_string(16, 2, "Save Filename (e.g. res.csv)",
+  g_config.estimator =
+      get_input_int(15, 2, "Estimator (0=Plain MC, 1=Splitting)");
+  if (g_config.estimator == EST_SPLITTING)
+    g_config.splitting_particles =
+        get_input_int(16, 2, "Particles per level (e.g. 100)");
+  get_input_string(17, 2, "Save Filename (e.g. res.csv)",
                    g_config.save_filename, 64);
+  g_config.record_count =
+      get_input_int(18, 2, "Record trajectories of N replications (0=No)");
+  if (g_config.record_count > 0)
+    g_config.record_first_repl =
+        get_input_int(19, 2, "First replication to record (e.g. 0)");
 
   g_config.initial_mode = MODE_INTERACTIVE;
 }
@@ -95,6 +125,12 @@ int load_config_from_file_ui() {
              &g_config.prob_right);
       params_found = 1;
     }
+    if (strncmp(line, "# Estimator:", 12) == 0) {
+      int estimator;
+      sscanf(line, "# Estimator: %d/%d", &estimator,
+             &g_config.splitting_particles);
+      g_config.estimator = (Estimator)estimator;
+    }
     if (strncmp(line, "# Map:", 6) == 0) {
       map_found = 1;
       for (int r = 0; r < g_config.rows; r++) {
@@ -139,14 +175,92 @@ int load_config_from_file_ui() {
   return 1;
 }
 
+int level_width() { return (g_config.cols + (1 << g_zoom) - 1) >> g_zoom; }
+
+int level_height() { return (g_config.rows + (1 << g_zoom) - 1) >> g_zoom; }
+
+int view_cols() {
+  int n = COLS / 4;
+  if (n > level_width())
+    n = level_width();
+  return (n > 0) ? n : 1;
+}
+
+int view_rows() {
+  int n = LINES - 6;
+  if (n > level_height())
+    n = level_height();
+  return (n > 0) ? n : 1;
+}
+
+// Moves a view's origin just far enough that pos is within its first
+// visible cells.
+void scroll_to_show(int pos, int *origin, int visible) {
+  if (pos < *origin)
+    *origin = pos;
+  if (pos >= *origin + visible)
+    *origin = pos - visible + 1;
+}
+
+void send_viewport() {
+  scroll_to_show(g_cursor_x, &g_view_x, view_cols());
+  scroll_to_show(g_cursor_y, &g_view_y, view_rows());
+
+  Message msg;
+  msg.type = MSG_CONTROL;
+  msg.payload.control.cmd = CMD_SET_VIEWPORT;
+  msg.payload.control.x = g_view_x;
+  msg.payload.control.y = g_view_y;
+  msg.payload.control.width = view_cols();
+  msg.payload.control.height = view_rows();
+  msg.payload.control.zoom = g_zoom;
+  send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
+}
+
+void set_zoom(int zoom) {
+  if (zoom < 0 || zoom >= PYRAMID_MAX_LEVELS)
+    return;
+  if (zoom > g_zoom && level_width() == 1 && level_height() == 1)
+    return;
+
+  int shift = zoom - g_zoom;
+  if (shift > 0) {
+    g_cursor_x >>= shift;
+    g_cursor_y >>= shift;
+  } else {
+    g_cursor_x <<= -shift;
+    g_cursor_y <<= -shift;
+  }
+  g_zoom = zoom;
+  g_view_x = 0;
+  g_view_y = 0;
+  memset(g_stats_cache, 0, sizeof(g_stats_cache));
+  send_viewport();
+}
+
+void format_steps(char *buf, size_t size, float steps) {
+  if (steps < 0)
+    snprintf(buf, size, ">%d", g_histogram.bucket_lower[HIST_OVERFLOW_BUCKET]);
+  else
+    snprintf(buf, size, "%.1f", steps);
+}
+
 void draw_grid(int walker_x, int walker_y, int repl_id, int total_repl) {
   erase();
   mvprintw(0, 0,
-           "Sim: %d/%d | 'p' Pause 'r' Resume 'm' Mode 'v' View(Stat) 'q' Quit",
-           repl_id, total_repl);
+           "Sim: %d/%d | 'p' Pause 'r' Resume 'm' Mode 'v' View(Stat) "
+           "Arrows+'h' Hist '+'/'-' Zoom(%d) 'c' K/Probs 'q' Quit",
+           repl_id, total_repl, g_zoom);
+
+  if (walker_x != -1) {
+    walker_x >>= g_zoom;
+    walker_y >>= g_zoom;
+  }
 
-  for (int y = 0; y < g_config.rows; y++) {
-    for (int x = 0; x < g_config.cols; x++) {
+  for (int vy = 0; vy < view_rows(); vy++) {
+    for (int vx = 0; vx < view_cols(); vx++) {
+      int x = g_view_x + vx;
+      int y = g_view_y + vy;
       char sym = '.';
       int color = 0;
 
@@ -171,6 +285,8 @@ void draw_grid(int walker_x, int walker_y, int repl_id, int total_repl) {
         attron(COLOR_PAIR(2));
       else if (color == 1)
         attron(COLOR_PAIR(1));
+      if (walker_x == -1 && x == g_cursor_x && y == g_cursor_y)
+        attron(A_REVERSE);
 
       if (walker_x == -1 && !g_stats_cache[x][y].is_obstacle &&
           (x != 0 || y != 0)) {
@@ -179,18 +295,446 @@ void draw_grid(int walker_x, int walker_y, int repl_id, int total_repl) {
                         : g_stats_cache[x][y].prob_reach_center_k;
         if (val > 99)
           val = 99;
-        mvprintw(y + 2, x * 4, "%3.0f ", val);
+        mvprintw(vy + 2, vx * 4, "%3.0f ", val);
       } else {
-        mvprintw(y + 2, x * 4, " %c  ", sym);
+        mvprintw(vy + 2, vx * 4, " %c  ", sym);
       }
 
+      attroff(A_REVERSE);
       if (color != 0)
         attroff(COLOR_PAIR(color));
     }
   }
+
+  if (g_has_histogram) {
+    char median[16], p95[16];
+    format_steps(median, sizeof(median), g_histogram.median_steps);
+    format_steps(p95, sizeof(p95), g_histogram.p95_steps);
+    char where[64];
+    if (g_histogram.width == 1 && g_histogram.height == 1)
+      snprintf(where, sizeof(where), "Cell (%d,%d)", g_histogram.x,
+               g_histogram.y);
+    else
+      snprintf(where, sizeof(where), "Cells (%d..%d,%d..%d)", g_histogram.x,
+               g_histogram.x + g_histogram.width - 1, g_histogram.y,
+               g_histogram.y + g_histogram.height - 1);
+    mvprintw(view_rows() + 3, 0, "%s: %u hits, median %s, p95 %s steps",
+             where, g_histogram.samples, median, p95);
+  }
+  if (g_status_msg[0])
+    mvprintw(view_rows() + 4, 0, "%s", g_status_msg);
   refresh();
 }
 
+typedef struct {
+  TrajRecordHeader header;
+  long moves_offset;
+} TrajIndexEntry;
+
+void replay_move(const TrajFileHeader *h, const unsigned char *grid, int dir,
+                 int *x, int *y) {
+  int nx = *x;
+  int ny = *y;
+
+  if (dir == 0)
+    ny--;
+  else if (dir == 1)
+    ny++;
+  else if (dir == 2)
+    nx--;
+  else
+    nx++;
+
+  if (h->use_obstacles == 0) {
+    nx = (nx + h->cols) % h->cols;
+    ny = (ny + h->rows) % h->rows;
+  } else if (nx < 0 || nx >= h->cols || ny < 0 || ny >= h->rows ||
+             grid[ny * h->cols + nx]) {
+    return;
+  }
+  *x = nx;
+  *y = ny;
+}
+
+int replay_dir(const unsigned char *moves, int step) {
+  return (moves[step / TRAJ_MOVES_PER_BYTE] >>
+          ((step % TRAJ_MOVES_PER_BYTE) * 2)) &
+         3;
+}
+
+void draw_replay(const TrajFileHeader *h, const unsigned char *grid,
+                 const TrajIndexEntry *entry, int walk, int num_walks,
+                 int step, int x, int y, double speed, int playing,
+                 int *view_x, int *view_y) {
+  erase();
+  mvprintw(0, 0,
+           "Replay: walk %d/%d (repl %d, start %d,%d) step %d/%d %s | "
+           "%.0f steps/s %s",
+           walk + 1, num_walks, entry->header.replication_id,
+           entry->header.start_x, entry->header.start_y, step,
+           entry->header.num_steps,
+           entry->header.reached_center ? "reached" : "timed out", speed,
+           playing ? "" : "(paused)");
+  mvprintw(1, 0,
+           "Space Play/Pause '+'/'-' Speed Arrows/PgUp/PgDn/Home/End Seek "
+           "'n'/'p' Walk 'q' Quit");
+
+  int max_rows = (LINES - 3 > 1) ? LINES - 3 : 1;
+  int max_cols = (COLS / 4 > 1) ? COLS / 4 : 1;
+  scroll_to_show(x, view_x, max_cols);
+  scroll_to_show(y, view_y, max_rows);
+  for (int vy = 0; vy < max_rows && *view_y + vy < h->rows; vy++) {
+    for (int vx = 0; vx < max_cols && *view_x + vx < h->cols; vx++) {
+      int gx = *view_x + vx;
+      int gy = *view_y + vy;
+      char sym = grid[gy * h->cols + gx] ? '#' : '.';
+      int color = 0;
+      if (gx == 0 && gy == 0) {
+        sym = 'T';
+        color = 2;
+      }
+      if (gx == x && gy == y) {
+        sym = 'W';
+        color = 1;
+      }
+      if (color != 0)
+        attron(COLOR_PAIR(color));
+      mvprintw(vy + 3, vx * 4, " %c  ", sym);
+      if (color != 0)
+        attroff(COLOR_PAIR(color));
+    }
+  }
+  refresh();
+}
+
+void replay_ui() {
+  char filename[256];
+  clear();
+  draw_text_centered(1, "--- Replay Trajectories ---");
+  get_input_string(3, 2, "Enter trajectory file (e.g. res.csv.traj)", filename,
+                   255);
+
+  FILE *f = fopen(filename, "rb");
+  TrajFileHeader h;
+  if (!f || fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRAJ_MAGIC ||
+      h.version != TRAJ_VERSION) {
+    mvprintw(5, 2, "Error: Not a trajectory file!");
+    getch();
+    if (f)
+      fclose(f);
+    return;
+  }
+
+  unsigned char *grid = (unsigned char *)malloc(h.rows * h.cols);
+  fread(grid, 1, h.rows * h.cols, f);
+
+  int num_walks = 0;
+  int capacity = 64;
+  TrajIndexEntry *index =
+      (TrajIndexEntry *)malloc(capacity * sizeof(TrajIndexEntry));
+  TrajRecordHeader rec;
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (num_walks == capacity) {
+      capacity *= 2;
+      index = (TrajIndexEntry *)realloc(index,
+                                        capacity * sizeof(TrajIndexEntry));
+    }
+    index[num_walks].header = rec;
+    index[num_walks].moves_offset = ftell(f);
+    num_walks++;
+    fseek(f, (rec.num_steps + TRAJ_MOVES_PER_BYTE - 1) / TRAJ_MOVES_PER_BYTE,
+          SEEK_CUR);
+  }
+
+  if (num_walks == 0) {
+    mvprintw(5, 2, "No recorded walks in file.");
+    getch();
+    free(grid);
+    free(index);
+    fclose(f);
+    return;
+  }
+
+  unsigned char *moves = (unsigned char *)malloc(h.max_steps_k + 1);
+  int walk = -1;
+  int next_walk = 0;
+  int step = 0, target = 0;
+  int x = 0, y = 0;
+  int view_x = 0, view_y = 0;
+  double speed = 20;
+  double pending = 0;
+  int playing = 1;
+
+  curs_set(0);
+  nodelay(stdscr, TRUE);
+
+  while (1) {
+    if (next_walk != walk) {
+      walk = next_walk;
+      TrajRecordHeader *r = &index[walk].header;
+      fseek(f, index[walk].moves_offset, SEEK_SET);
+      fread(moves, 1,
+            (r->num_steps + TRAJ_MOVES_PER_BYTE - 1) / TRAJ_MOVES_PER_BYTE, f);
+      step = target = 0;
+      x = r->start_x;
+      y = r->start_y;
+      pending = 0;
+    }
+
+    TrajRecordHeader *r = &index[walk].header;
+    int ch = getch();
+    if (ch == 'q')
+      break;
+    else if (ch == ' ')
+      playing = !playing;
+    else if (ch == '+' && speed < 1e6)
+      speed *= 2;
+    else if (ch == '-' && speed > 1)
+      speed /= 2;
+    else if (ch == 'n' && walk < num_walks - 1)
+      next_walk = walk + 1;
+    else if (ch == 'p' && walk > 0)
+      next_walk = walk - 1;
+    else if (ch == KEY_RIGHT)
+      target = step + 1;
+    else if (ch == KEY_LEFT)
+      target = step - 1;
+    else if (ch == KEY_NPAGE)
+      target = step + 100;
+    else if (ch == KEY_PPAGE)
+      target = step - 100;
+    else if (ch == KEY_HOME)
+      target = 0;
+    else if (ch == KEY_END)
+      target = r->num_steps;
+
+    if (next_walk != walk)
+      continue;
+
+    if (playing) {
+      pending += speed * 0.02;
+      target += (int)pending;
+      pending -= (int)pending;
+    }
+    if (target < 0)
+      target = 0;
+    if (target > r->num_steps)
+      target = r->num_steps;
+
+    if (target < step) {
+      step = 0;
+      x = r->start_x;
+      y = r->start_y;
+    }
+    while (step < target)
+      replay_move(&h, grid, replay_dir(moves, step++), &x, &y);
+
+    draw_replay(&h, grid, &index[walk], walk, num_walks, step, x, y, speed,
+                playing, &view_x, &view_y);
+    usleep(20000);
+  }
+
+  nodelay(stdscr, FALSE);
+  curs_set(1);
+  free(moves);
+  free(grid);
+  free(index);
+  fclose(f);
+}
+
+void reconfigure_ui() {
+  char prompt[32];
+  char buf[32];
+  // The header and five prompts need six rows; on a tall grid they go over
+  // the bottom of it rather than off the screen.
+  int y = view_rows() + 5;
+  if (y > LINES - 6)
+    y = LINES - 6;
+  if (y < 0)
+    y = 0;
+  Message msg;
+  msg.type = MSG_CONTROL;
+  msg.payload.control.cmd = CMD_RECONFIGURE;
+
+  g_prompting = 1;
+  nodelay(stdscr, FALSE);
+  move(y, 0);
+  clrtobot();
+  mvprintw(y, 0, "New values (empty keeps current):");
+
+  snprintf(prompt, sizeof(prompt), "K [%d]", g_config.max_steps_k);
+  get_input_string(y + 1, 2, prompt, buf, 31);
+  msg.payload.control.max_steps_k = buf[0] ? atoi(buf) : g_config.max_steps_k;
+
+  float *probs[] = {&g_config.prob_up, &g_config.prob_down,
+                    &g_config.prob_left, &g_config.prob_right};
+  float *out[] = {&msg.payload.control.prob_up, &msg.payload.control.prob_down,
+                  &msg.payload.control.prob_left,
+                  &msg.payload.control.prob_right};
+  char *names[] = {"Up", "Down", "Left", "Right"};
+  for (int i = 0; i < 4; i++) {
+    snprintf(prompt, sizeof(prompt), "%s [%.2f]", names[i], *probs[i]);
+    get_input_string(y + 2 + i, 2, prompt, buf, 31);
+    *out[i] = buf[0] ? atof(buf) : *probs[i];
+  }
+
+  float sum = msg.payload.control.prob_up + msg.payload.control.prob_down +
+              msg.payload.control.prob_left + msg.payload.control.prob_right;
+  int unchanged = msg.payload.control.max_steps_k == g_config.max_steps_k;
+  for (int i = 0; i < 4; i++)
+    unchanged = unchanged && *out[i] == *probs[i];
+  if (unchanged) {
+    // Nothing to send; keep whatever status arrived while prompting.
+  } else if (msg.payload.control.max_steps_k > 0 && sum > 0.99f &&
+             sum < 1.01f) {
+    snprintf(g_status_msg, sizeof(g_status_msg),
+             "Reconfiguration requested...");
+    send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
+  } else {
+    snprintf(g_status_msg, sizeof(g_status_msg),
+             "Invalid values, configuration unchanged.");
+  }
+
+  nodelay(stdscr, TRUE);
+  g_prompting = 0;
+  draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
+}
+
+// Copies the server's latest stats out of shared memory. Returns 1 if the
+// cache changed, 0 if nothing new was published or the server was mid-write.
+int poll_shared_stats() {
+  static CellStats cells[MAX_GRID_SIZE * MAX_GRID_SIZE];
+  SharedStats *shm = g_shared_stats;
+  unsigned int seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+  if (seq == g_shared_seq || (seq & 1))
+    return 0;
+
+  // Copy out first and only commit to the cache once seq shows the writer
+  // did not touch the block while we were reading it.
+  int zoom = shm->zoom;
+  int num_cells = shm->num_cells;
+  int repl_done = shm->total_replications_done;
+  int repl_total = shm->total_replications_target;
+  if (num_cells < 0 || num_cells > MAX_GRID_SIZE * MAX_GRID_SIZE)
+    num_cells = 0;
+  memcpy(cells, shm->cells, num_cells * sizeof(CellStats));
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq)
+    return 0;
+
+  g_shared_seq = seq;
+  g_stats_repl_done = repl_done;
+  g_stats_repl_total = repl_total;
+  if (zoom != g_zoom)
+    return 0;
+  for (int i = 0; i < num_cells; i++) {
+    CellStats *cs = &cells[i];
+    if (cs->x >= 0 && cs->x < MAX_GRID_SIZE && cs->y >= 0 &&
+        cs->y < MAX_GRID_SIZE)
+      g_stats_cache[cs->x][cs->y] = *cs;
+  }
+  return 1;
+}
+
+// Spawns the server next to us. The server gets one end of a socketpair for
+// messages and a memfd holding SharedStats, so no port is bound and the
+// stats grid is never copied through the kernel.
+int start_local_server(char **argv) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+    return -1;
+
+  int shm_fd = memfd_create("random_walk_stats", 0);
+  if (shm_fd >= 0 && ftruncate(shm_fd, sizeof(SharedStats)) == 0) {
+    void *shm = mmap(NULL, sizeof(SharedStats), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, shm_fd, 0);
+    if (shm != MAP_FAILED)
+      g_shared_stats = (SharedStats *)shm;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    char fd_arg[16], shm_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+    snprintf(shm_arg, sizeof(shm_arg), "%d", shm_fd);
+    close(sv[0]);
+
+    int n = 0;
+    while (argv[n])
+      n++;
+    char **args = (char **)calloc(n + 5, sizeof(char *));
+    args[0] = "./server";
+    for (int i = 1; i < n; i++)
+      args[i] = argv[i];
+    args[n] = "--fd";
+    args[n + 1] = fd_arg;
+    if (g_shared_stats) {
+      args[n + 2] = "--shm-fd";
+      args[n + 3] = shm_arg;
+    }
+    execv("./server", args);
+    perror("Exec failed");
+    exit(1);
+  }
+
+  close(sv[1]);
+  if (shm_fd >= 0)
+    close(shm_fd);
+  if (pid < 0) {
+    close(sv[0]);
+    return -1;
+  }
+  g_socket = sv[0];
+  return 0;
+}
+
+int connect_tcp_server(const char *host, int port, char **argv) {
+  if (!host) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      argv[0] = "./server";
+      execv("./server", argv);
+      perror("Exec failed");
+      exit(1);
+    }
+    sleep(1);
+    host = "127.0.0.1";
+  }
+
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, service, &hints, &res) != 0)
+    return -1;
+
+  int rc = -1;
+  g_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (g_socket != INVALID_SOCKET &&
+      connect(g_socket, res->ai_addr, res->ai_addrlen) == 0)
+    rc = 0;
+  freeaddrinfo(res);
+  return rc;
+}
+
+// Returns -1 when nothing is waiting, 0 once the server has closed the
+// session. Over TCP a message can arrive in pieces, so a partial read is
+// completed before it is handed on.
+int recv_message(Message *msg) {
+  int len = recv(g_socket, (char *)msg, sizeof(*msg), MSG_DONTWAIT);
+  if (len > 0 && len < (int)sizeof(*msg)) {
+    int rest = recv(g_socket, (char *)msg + len, sizeof(*msg) - len,
+                    MSG_WAITALL);
+    if (rest <= 0)
+      return 0;
+    len += rest;
+  }
+  return len;
+}
+
 void *input_thread_func(void *arg) {
   while (g_running) {
     int ch = getch();
@@ -200,18 +744,45 @@ void *input_thread_func(void *arg) {
       if (ch == 'q') {
         msg.payload.control.cmd = CMD_STOP;
         g_running = 0;
-        send(g_socket, (char *)&msg, sizeof(msg), 0);
+        send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
       } else if (ch == 'p') {
         msg.payload.control.cmd = CMD_PAUSE;
-        send(g_socket, (char *)&msg, sizeof(msg), 0);
+        send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
       } else if (ch == 'r') {
         msg.payload.control.cmd = CMD_RESUME;
-        send(g_socket, (char *)&msg, sizeof(msg), 0);
+        send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
       } else if (ch == 'm') {
         msg.payload.control.cmd = CMD_SWITCH_MODE;
-        send(g_socket, (char *)&msg, sizeof(msg), 0);
+        send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
       } else if (ch == 'v') {
         g_view_mode = !g_view_mode;
+      } else if (ch == KEY_UP && g_cursor_y > 0) {
+        g_cursor_y--;
+        send_viewport();
+      } else if (ch == KEY_DOWN && g_cursor_y < level_height() - 1) {
+        g_cursor_y++;
+        send_viewport();
+      } else if (ch == KEY_LEFT && g_cursor_x > 0) {
+        g_cursor_x--;
+        send_viewport();
+      } else if (ch == KEY_RIGHT && g_cursor_x < level_width() - 1) {
+        g_cursor_x++;
+        send_viewport();
+      } else if (ch == '+') {
+        set_zoom(g_zoom - 1);
+      } else if (ch == '-') {
+        set_zoom(g_zoom + 1);
+      } else if (ch == KEY_RESIZE) {
+        send_viewport();
+      } else if (ch == 'c') {
+        if (g_session_open)
+          reconfigure_ui();
+      } else if (ch == 'h') {
+        msg.payload.control.cmd = CMD_REQUEST_HISTOGRAM;
+        msg.payload.control.x = g_cursor_x;
+        msg.payload.control.y = g_cursor_y;
+        msg.payload.control.zoom = g_zoom;
+        send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
       }
     }
     usleep(50000);
@@ -219,9 +790,21 @@ void *input_thread_func(void *arg) {
   return NULL;
 }
 
-int main() {
+int main(int argc, char **argv) {
   init_sockets();
 
+  int port = PORT;
+  int use_tcp = 0;
+  const char *host = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+      port = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--tcp") == 0)
+      use_tcp = 1;
+    else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc)
+      host = argv[i + 1];
+  }
+
   initscr();
   cbreak();
   keypad(stdscr, TRUE);
@@ -236,8 +819,9 @@ int main() {
     draw_text_centered(2, "=== Random Walk Simulation ===");
     draw_text_centered(4, "1. New Simulation");
     draw_text_centered(5, "2. Load/Re-run Simulation");
-    draw_text_centered(6, "3. Exit");
-    draw_text_centered(8, "Enter choice: ");
+    draw_text_centered(6, "3. Replay Trajectories");
+    draw_text_centered(7, "4. Exit");
+    draw_text_centered(9, "Enter choice: ");
 
     echo();
     char buf[10];
@@ -245,7 +829,9 @@ int main() {
     choice = atoi(buf);
     noecho();
 
-    if (choice == 3) {
+    if (choice == 3)
+      replay_ui();
+    if (choice == 4) {
       endwin();
       return 0;
     }
@@ -259,27 +845,9 @@ int main() {
     }
   }
 
-  pid_t pid = fork();
-  if (pid == 0) {
-    execl("./server", "./server", NULL);
-    perror("Exec failed");
-    exit(1);
-  }
-
-  sleep(1);
-
-  struct sockaddr_in serv_addr;
-  if ((g_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    endwin();
-    printf("\n Socket creation error \n");
-    return -1;
-  }
-
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(PORT);
-  inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
-
-  if (connect(g_socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+  int rc = (use_tcp || host) ? connect_tcp_server(host, port, argv)
+                             : start_local_server(argv);
+  if (rc < 0) {
     endwin();
     printf("\nConnection Failed \n");
     return -1;
@@ -288,7 +856,8 @@ int main() {
   Message msg;
   msg.type = MSG_CONFIG;
   msg.payload.config = g_config;
-  send(g_socket, (char *)&msg, sizeof(msg), 0);
+  send(g_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
+  send_viewport();
 
   pthread_t thread_id;
   pthread_create(&thread_id, NULL, input_thread_func, NULL);
@@ -297,41 +866,83 @@ int main() {
   nodelay(stdscr, TRUE);
 
   while (g_running) {
+    if (g_shared_stats && poll_shared_stats() && !g_prompting)
+      draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
+
     Message update;
-    int len = recv(g_socket, (char *)&update, sizeof(update), MSG_DONTWAIT);
-    if (len > 0) {
-      if (update.type == MSG_STATE_UPDATE) {
-        draw_grid(update.payload.state.pos.x, update.payload.state.pos.y,
-                  update.payload.state.replication_id,
-                  update.payload.state.total_replications);
+    int len = g_session_open ? recv_message(&update) : -1;
+    if (len == 0) {
+      g_session_open = 0;
+      snprintf(g_status_msg, sizeof(g_status_msg),
+               "Server closed the session. Press 'q' to quit.");
+      if (!g_prompting)
+        draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
+    } else if (len > 0) {
+      if (update.type == MSG_CONTROL &&
+          update.payload.control.cmd == CMD_RECONFIGURE) {
+        // The server echoes a reconfiguration once it has accepted it.
+        ControlMsg *ctl = &update.payload.control;
+        g_config.max_steps_k = ctl->max_steps_k;
+        g_config.prob_up = ctl->prob_up;
+        g_config.prob_down = ctl->prob_down;
+        g_config.prob_left = ctl->prob_left;
+        g_config.prob_right = ctl->prob_right;
+        snprintf(g_status_msg, sizeof(g_status_msg),
+                 "Reconfigured: K=%d, Prob=%.2f/%.2f/%.2f/%.2f",
+                 g_config.max_steps_k, g_config.prob_up, g_config.prob_down,
+                 g_config.prob_left, g_config.prob_right);
+        if (!g_prompting)
+          draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
+      } else if (update.type == MSG_ERROR) {
+        snprintf(g_status_msg, sizeof(g_status_msg), "Server error: %s",
+                 update.payload.error_msg);
+        if (!g_prompting)
+          draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
+      } else if (update.type == MSG_STATE_UPDATE) {
+        if (!g_prompting)
+          draw_grid(update.payload.state.pos.x, update.payload.state.pos.y,
+                    update.payload.state.replication_id,
+                    update.payload.state.total_replications);
       } else if (update.type == MSG_STATS_UPDATE) {
         StatsUpdateMsg *stats = &update.payload.stats;
+        if (stats->zoom != g_zoom)
+          continue;
         g_stats_repl_done = stats->total_replications_done;
         g_stats_repl_total = stats->total_replications_target;
 
         for (int i = 0; i < stats->num_cells; i++) {
           int cx = stats->cells[i].x;
           int cy = stats->cells[i].y;
-          g_stats_cache[cx][cy] = stats->cells[i];
+          if (cx < MAX_GRID_SIZE && cy < MAX_GRID_SIZE)
+            g_stats_cache[cx][cy] = stats->cells[i];
         }
 
-        draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
+        if (!g_prompting)
+          draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
+      } else if (update.type == MSG_HISTOGRAM) {
+        g_histogram = update.payload.histogram;
+        g_has_histogram = 1;
+        if (!g_prompting)
+          draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
       } else if (update.type == MSG_GAME_OVER) {
-        mvprintw(g_config.rows + 4, 0, "Simulation Complete. %s",
+        snprintf(g_status_msg, sizeof(g_status_msg),
+                 "Simulation Complete. %s 'c' to change K/Probs, 'q' to quit.",
                  update.payload.game_over_msg);
-        refresh();
-        g_running = 0;
+        if (!g_prompting)
+          draw_grid(-1, -1, g_stats_repl_done, g_stats_repl_total);
       }
     }
     usleep(10000);
   }
 
   nodelay(stdscr, FALSE);
-  mvprintw(g_config.rows + 5, 0, "Press any key to exit...");
+  mvprintw(view_rows() + 5, 0, "Press any key to exit...");
   getch();
   endwin();
 
   CLOSE_SOCKET(g_socket);
+  if (g_shared_stats)
+    munmap(g_shared_stats, sizeof(SharedStats));
   cleanup_sockets();
   return 0;
 }
@@ -5,6 +5,11 @@
 
 #define MAX_GRID_SIZE 100
 #define MAX_FILENAME 256
+#define HIST_BUCKETS 64
+// The last bucket collects every walk too long for the log scale; a
+// quantile that falls into it is reported as -1 (i.e. above its lower bound).
+#define HIST_OVERFLOW_BUCKET (HIST_BUCKETS - 1)
+#define PYRAMID_MAX_LEVELS 8
 
 typedef enum {
   MSG_CONFIG,
@@ -13,11 +18,18 @@ typedef enum {
   MSG_STATS_UPDATE,
   MSG_CONTROL,
   MSG_GAME_OVER,
-  MSG_ERROR
+  MSG_ERROR,
+  MSG_SHARD,
+  MSG_SHARD_RESULT,
+  MSG_HISTOGRAM
 } MessageType;
 
 typedef enum { MODE_INTERACTIVE, MODE_SUMMARY } SimMode;
 
+typedef enum { EST_PLAIN, EST_SPLITTING } Estimator;
+
+#define DEFAULT_SPLITTING_PARTICLES 100
+
 typedef struct {
   int rows;
   int cols;
@@ -31,6 +43,10 @@ typedef struct {
   int use_obstacles;
   int obstacle_map[MAX_GRID_SIZE][MAX_GRID_SIZE];
   SimMode initial_mode;
+  Estimator estimator;
+  int splitting_particles;
+  int record_first_repl;
+  int record_count;
 } ConfigMsg;
 
 typedef struct {
@@ -51,6 +67,7 @@ typedef struct {
   int y;
   float avg_steps_to_center;
   float prob_reach_center_k;
+  float prob_std_error;
   int is_obstacle;
 } CellStats;
 
@@ -61,19 +78,71 @@ typedef struct {
   int total_replications_done;
   int total_replications_target;
   int final_update;
+  int zoom;
 } StatsUpdateMsg;
 
 typedef enum {
   CMD_PAUSE,
   CMD_RESUME,
   CMD_SWITCH_MODE,
-  CMD_STOP
+  CMD_STOP,
+  CMD_REQUEST_HISTOGRAM,
+  CMD_SET_VIEWPORT,
+  CMD_RECONFIGURE
 } ControlCommand;
 
 typedef struct {
   ControlCommand cmd;
+  int x;
+  int y;
+  int width;
+  int height;
+  int zoom;
+  int max_steps_k;
+  float prob_up;
+  float prob_down;
+  float prob_left;
+  float prob_right;
 } ControlMsg;
 
+// Covers the width x height block of cells whose top-left cell is (x, y);
+// at zoom 0 that is a single cell.
+typedef struct {
+  int x;
+  int y;
+  int width;
+  int height;
+  unsigned int samples;
+  float median_steps;
+  float p95_steps;
+  int bucket_lower[HIST_BUCKETS];
+  unsigned int buckets[HIST_BUCKETS];
+} HistogramMsg;
+
+typedef struct {
+  ConfigMsg config;
+  int shard_id;
+  unsigned int seed;
+  int first_replication;
+} ShardMsg;
+
+#define SHARD_CHUNK_SIZE 100
+typedef struct {
+  int shard_id;
+  int offset;
+  int num_cells;
+  int last_chunk;
+  int replications_done;
+  int final_update;
+  long total_steps[SHARD_CHUNK_SIZE];
+  int reached_center_count[SHARD_CHUNK_SIZE];
+  int walks_started[SHARD_CHUNK_SIZE];
+  double est_prob_sum[SHARD_CHUNK_SIZE];
+  double est_prob_sq_sum[SHARD_CHUNK_SIZE];
+  double est_steps_sum[SHARD_CHUNK_SIZE];
+  unsigned int hist[SHARD_CHUNK_SIZE][HIST_BUCKETS];
+} ShardResultMsg;
+
 typedef struct {
   MessageType type;
   union {
@@ -81,9 +150,54 @@ typedef struct {
     StateUpdateMsg state;
     StatsUpdateMsg stats;
     ControlMsg control;
+    ShardMsg shard;
+    ShardResultMsg shard_result;
+    HistogramMsg histogram;
     char error_msg[256];
     char game_over_msg[256];
   } payload;
 } Message;
 
+// Live stats shared with a co-located client. The server is the only
+// writer; seq is odd while it is updating, so a reader retries if seq was
+// odd or changed across its copy.
+typedef struct {
+  unsigned int seq;
+  int num_cells;
+  int zoom;
+  int total_replications_done;
+  int total_replications_target;
+  int final_update;
+  CellStats cells[MAX_GRID_SIZE * MAX_GRID_SIZE];
+} SharedStats;
+
+// Trajectory file: TrajFileHeader, rows * cols obstacle bytes, then one
+// TrajRecordHeader per walk followed by its moves packed 2 bits each
+// (0=up, 1=down, 2=left, 3=right), lowest bits first.
+#define TRAJ_MAGIC 0x4a525452
+#define TRAJ_VERSION 1
+#define TRAJ_MOVES_PER_BYTE 4
+
+typedef struct {
+  unsigned int magic;
+  int version;
+  int rows;
+  int cols;
+  int max_steps_k;
+  int use_obstacles;
+  float prob_up;
+  float prob_down;
+  float prob_left;
+  float prob_right;
+} TrajFileHeader;
+
+typedef struct {
+  int replication_id;
+  int start_x;
+  int start_y;
+  unsigned int seed;
+  int num_steps;
+  int reached_center;
+} TrajRecordHeader;
+
 #endif
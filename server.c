@@ -2,18 +2,128 @@
 #include "protocol.h"
 #include <errno.h>
 #include <math.h>
+#include <netdb.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <time.h>
 
+#define STATS_INTERVAL_MS 250
+#define SHARD_INTERVAL_MS 5000
+#define RELIABLE_QUEUE_SIZE 16
+#define STATE_QUEUE_SIZE 8
+#define REPLY_QUEUE_SIZE 4
+#define MAX_RETAINED_WALKS 16000000
+
 typedef struct {
-  int rows;
-  int cols;
-  int *grid;
   long *total_steps;
   int *reached_center_count;
   int *walks_started;
+  double *est_prob_sum;
+  double *est_prob_sq_sum;
+  double *est_steps_sum;
+  unsigned int *hist;
+} Accumulators;
+
+typedef struct {
+  unsigned short *pos;
+  int count;
+  int capacity;
+} AliveList;
+
+typedef struct {
+  int rows;
+  int cols;
+  int *grid;
+  int *dist_to_center;
+  Accumulators acc;
+  AliveList *alive;
+  long alive_total;
+  int alive_complete;
 } World;
 
+typedef struct {
+  Accumulators acc;
+  int repl_done;
+  int repl_total;
+  int final;
+  int max_steps_k;
+  float prob_up;
+  float prob_down;
+  float prob_left;
+  float prob_right;
+} StatsSnapshot;
+
+typedef struct {
+  int width;
+  int height;
+  double *sum_avg;
+  double *sum_prob;
+  double *sum_err;
+  int *valid;
+  int *obstacles;
+  int *cells;
+} PyramidLevel;
+
+typedef struct {
+  int num_levels;
+  PyramidLevel levels[PYRAMID_MAX_LEVELS];
+} Pyramid;
+
+typedef struct {
+  int x;
+  int y;
+  int width;
+  int height;
+  int zoom;
+} Viewport;
+
+typedef struct {
+  StatsSnapshot slots[2];
+  int ready;
+  int sending;
+  int done;
+  Pyramid pyramid;
+  Viewport view;
+  int view_changed;
+  int last_repl_done;
+  int last_repl_total;
+  long next_shard_arrays;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+} Reporter;
+
+typedef struct {
+  Message *items;
+  int capacity;
+  int head;
+  int count;
+  long dropped;
+} MessageRing;
+
+typedef struct {
+  MessageRing reliable;
+  MessageRing replies;
+  MessageRing state;
+  long sent;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_t thread;
+} OutboundQueue;
+
+typedef enum { ROLE_STANDALONE, ROLE_COORDINATOR, ROLE_WORKER } ServerRole;
+
+typedef struct {
+  SOCKET sock;
+  Accumulators acc;
+  Accumulators incoming;
+  int repl_done;
+  int final;
+} WorkerLink;
+
 typedef struct {
   ConfigMsg config;
   World world;
@@ -21,6 +131,20 @@ typedef struct {
   int paused;
   SimMode current_mode;
   SOCKET client_socket;
+  OutboundQueue outbound;
+  Reporter reporter;
+  ServerRole role;
+  int shard_id;
+  int first_replication;
+  WorkerLink *workers;
+  int num_workers;
+  unsigned int seed;
+  FILE *traj_file;
+  unsigned char *traj_moves;
+  int traj_config;
+  int reconfig_pending;
+  ControlMsg reconfig;
+  SharedStats *shared_stats;
 } ServerState;
 
 ServerState g_state;
@@ -31,6 +155,154 @@ typedef struct {
   int x, y;
 } Point;
 
+typedef struct {
+  int x, y;
+  int steps;
+} Particle;
+
+// Hitting-time histogram buckets: exact below 8, then four buckets per power
+// of two, so each bucket is at most 25% wide and a cell costs a fixed
+// HIST_BUCKETS counters regardless of K or the number of walks.
+int hist_bucket(int steps) {
+  if (steps < 8)
+    return steps;
+  int e = 3;
+  while ((steps >> (e + 1)) > 0)
+    e++;
+  int b = 8 + (e - 3) * 4 + ((steps >> (e - 2)) & 3);
+  return (b < HIST_OVERFLOW_BUCKET) ? b : HIST_OVERFLOW_BUCKET;
+}
+
+int hist_bucket_lower(int b) {
+  if (b < 8)
+    return b;
+  int e = (b - 8) / 4 + 3;
+  return (4 + (b - 8) % 4) << (e - 2);
+}
+
+double hist_quantile(const unsigned int *buckets, double q) {
+  unsigned long total = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    total += buckets[b];
+  if (total == 0)
+    return 0;
+
+  double target = q * total;
+  unsigned long cum = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    if (buckets[b] > 0 && cum + buckets[b] >= target) {
+      if (b == HIST_OVERFLOW_BUCKET)
+        return -1;
+      // Buckets below 8 hold a single step count.
+      double lower = hist_bucket_lower(b);
+      if (b < 8)
+        return lower;
+      double width = hist_bucket_lower(b + 1) - lower;
+      return lower + width * (target - cum) / buckets[b];
+    }
+    cum += buckets[b];
+  }
+  return -1;
+}
+
+void format_steps(char *buf, size_t size, double steps) {
+  if (steps < 0)
+    snprintf(buf, size, ">%d", hist_bucket_lower(HIST_OVERFLOW_BUCKET));
+  else
+    snprintf(buf, size, "%.1f", steps);
+}
+
+void move_walker(int x, int y, int dir, int *out_x, int *out_y) {
+  int next_x = x;
+  int next_y = y;
+
+  if (dir == 0)
+    next_y--;
+  else if (dir == 1)
+    next_y++;
+  else if (dir == 2)
+    next_x--;
+  else
+    next_x++;
+
+  if (g_state.config.use_obstacles == 0) {
+    if (next_x < 0)
+      next_x = g_state.config.cols - 1;
+    if (next_x >= g_state.config.cols)
+      next_x = 0;
+    if (next_y < 0)
+      next_y = g_state.config.rows - 1;
+    if (next_y >= g_state.config.rows)
+      next_y = 0;
+  } else {
+    if (next_x < 0 || next_x >= g_state.config.cols || next_y < 0 ||
+        next_y >= g_state.config.rows) {
+      next_x = x;
+      next_y = y;
+    } else if (g_state.world.grid[get_idx(next_x, next_y)] == 1) {
+      next_x = x;
+      next_y = y;
+    }
+  }
+
+  *out_x = next_x;
+  *out_y = next_y;
+}
+
+int step_walker(int *x, int *y) {
+  float r = (float)rand() / RAND_MAX;
+  int dir;
+
+  if (r < g_state.config.prob_up)
+    dir = 0;
+  else if (r < g_state.config.prob_up + g_state.config.prob_down)
+    dir = 1;
+  else if (r < g_state.config.prob_up + g_state.config.prob_down +
+                   g_state.config.prob_left)
+    dir = 2;
+  else
+    dir = 3;
+
+  move_walker(*x, *y, dir, x, y);
+  return dir;
+}
+
+// BFS distance (in moves) from every free cell to (0,0), -1 if unreachable.
+// A walker's distance changes by at most one per step, which is what lets the
+// splitting estimator use these values as nested levels.
+void compute_center_distances() {
+  int size = g_state.config.rows * g_state.config.cols;
+  int *dist = g_state.world.dist_to_center;
+  Point *queue = (Point *)malloc(size * sizeof(Point));
+  int head = 0, tail = 0;
+
+  for (int i = 0; i < size; i++)
+    dist[i] = -1;
+
+  if (g_state.world.grid[get_idx(0, 0)] == 1) {
+    free(queue);
+    return;
+  }
+
+  dist[get_idx(0, 0)] = 0;
+  queue[tail++] = (Point){0, 0};
+
+  while (head < tail) {
+    Point p = queue[head++];
+    for (int dir = 0; dir < 4; dir++) {
+      int nx, ny;
+      move_walker(p.x, p.y, dir, &nx, &ny);
+      int idx = get_idx(nx, ny);
+      if (dist[idx] == -1) {
+        dist[idx] = dist[get_idx(p.x, p.y)] + 1;
+        queue[tail++] = (Point){nx, ny};
+      }
+    }
+  }
+
+  free(queue);
+}
+
 int check_reachability() {
   int rows = g_state.config.rows;
   int cols = g_state.config.cols;
@@ -84,13 +356,55 @@ int check_reachability() {
   return all_reachable;
 }
 
+void alloc_accumulators(Accumulators *acc, int size) {
+  acc->total_steps = (long *)calloc(size, sizeof(long));
+  acc->reached_center_count = (int *)calloc(size, sizeof(int));
+  acc->walks_started = (int *)calloc(size, sizeof(int));
+  acc->est_prob_sum = (double *)calloc(size, sizeof(double));
+  acc->est_prob_sq_sum = (double *)calloc(size, sizeof(double));
+  acc->est_steps_sum = (double *)calloc(size, sizeof(double));
+  acc->hist =
+      (unsigned int *)calloc(size * HIST_BUCKETS, sizeof(unsigned int));
+}
+
+void copy_accumulators(Accumulators *dst, const Accumulators *src, int size) {
+  memcpy(dst->total_steps, src->total_steps, size * sizeof(long));
+  memcpy(dst->reached_center_count, src->reached_center_count,
+         size * sizeof(int));
+  memcpy(dst->walks_started, src->walks_started, size * sizeof(int));
+  memcpy(dst->est_prob_sum, src->est_prob_sum, size * sizeof(double));
+  memcpy(dst->est_prob_sq_sum, src->est_prob_sq_sum, size * sizeof(double));
+  memcpy(dst->est_steps_sum, src->est_steps_sum, size * sizeof(double));
+  memcpy(dst->hist, src->hist, size * HIST_BUCKETS * sizeof(unsigned int));
+}
+
+void free_accumulators(Accumulators *acc) {
+  if (acc->total_steps)
+    free(acc->total_steps);
+  if (acc->reached_center_count)
+    free(acc->reached_center_count);
+  if (acc->walks_started)
+    free(acc->walks_started);
+  if (acc->est_prob_sum)
+    free(acc->est_prob_sum);
+  if (acc->est_prob_sq_sum)
+    free(acc->est_prob_sq_sum);
+  if (acc->est_steps_sum)
+    free(acc->est_steps_sum);
+  if (acc->hist)
+    free(acc->hist);
+  memset(acc, 0, sizeof(*acc));
+}
+
 void generate_world() {
   int size = g_state.config.rows * g_state.config.cols;
   g_state.world.grid = (int *)calloc(size, sizeof(int));
-  g_state.world.total_steps = (long *)calloc(size, sizeof(long));
-  g_state.world.reached_center_count = (int *)calloc(size, sizeof(int));
-  g_state.world.walks_started = (int *)calloc(size, sizeof(int));
-  srand(time(NULL));
+  g_state.world.dist_to_center = (int *)calloc(size, sizeof(int));
+  alloc_accumulators(&g_state.world.acc, size);
+  g_state.world.alive = (AliveList *)calloc(size, sizeof(AliveList));
+  g_state.world.alive_complete = 1;
+  g_state.seed = (unsigned int)time(NULL);
+  srand(g_state.seed);
 
   if (g_state.config.use_obstacles == 2) {
     for (int y = 0; y < g_state.config.rows; y++) {
@@ -123,6 +437,8 @@ void generate_world() {
       }
     }
   }
+
+  compute_center_distances();
 }
 
 void init_server() {
@@ -130,21 +446,71 @@ void init_server() {
   g_state.running = 1;
 }
 
+void disconnect_workers() {
+  for (int i = 0; i < g_state.num_workers; i++) {
+    CLOSE_SOCKET(g_state.workers[i].sock);
+    free_accumulators(&g_state.workers[i].acc);
+    free_accumulators(&g_state.workers[i].incoming);
+  }
+  if (g_state.workers)
+    free(g_state.workers);
+  g_state.workers = NULL;
+  g_state.num_workers = 0;
+}
+
 void cleanup_server() {
   if (g_state.world.grid)
     free(g_state.world.grid);
-  if (g_state.world.total_steps)
-    free(g_state.world.total_steps);
-  if (g_state.world.reached_center_count)
-    free(g_state.world.reached_center_count);
-  if (g_state.world.walks_started)
-    free(g_state.world.walks_started);
+  if (g_state.world.dist_to_center)
+    free(g_state.world.dist_to_center);
+  free_accumulators(&g_state.world.acc);
+  if (g_state.world.alive) {
+    for (int i = 0; i < g_state.config.rows * g_state.config.cols; i++)
+      free(g_state.world.alive[i].pos);
+    free(g_state.world.alive);
+  }
+  free_accumulators(&g_state.reporter.slots[0].acc);
+  free_accumulators(&g_state.reporter.slots[1].acc);
+  disconnect_workers();
+}
+
+void send_histogram(int x, int y, int zoom);
+void set_viewport(const ControlMsg *ctl);
+void send_reply(const Message *msg);
+
+// Accepted reconfigurations are echoed back so the client only adopts the
+// new K and probabilities once the server has taken them.
+void queue_reconfig(const ControlMsg *ctl) {
+  Message reply;
+  float sum = ctl->prob_up + ctl->prob_down + ctl->prob_left + ctl->prob_right;
+  if (g_state.role == ROLE_COORDINATOR) {
+    reply.type = MSG_ERROR;
+    snprintf(reply.payload.error_msg, sizeof(reply.payload.error_msg),
+             "Reconfiguration is not supported with workers");
+  } else if (ctl->max_steps_k <= 0 || sum < 0.99f || sum > 1.01f) {
+    reply.type = MSG_ERROR;
+    snprintf(reply.payload.error_msg, sizeof(reply.payload.error_msg),
+             "Invalid K or probabilities, configuration unchanged");
+  } else {
+    g_state.reconfig = *ctl;
+    g_state.reconfig_pending = 1;
+    reply.type = MSG_CONTROL;
+    reply.payload.control = *ctl;
+  }
+  send_reply(&reply);
 }
 
 int check_client_messages() {
   Message msg;
   ssize_t bytes =
       recv(g_state.client_socket, (char *)&msg, sizeof(msg), MSG_DONTWAIT);
+  if (bytes > 0 && bytes < (ssize_t)sizeof(msg)) {
+    ssize_t rest = recv(g_state.client_socket, (char *)&msg + bytes,
+                        sizeof(msg) - bytes, MSG_WAITALL);
+    bytes = (rest <= 0) ? 0 : bytes + rest;
+  }
+  if (bytes == 0)
+    return -1;
   if (bytes > 0) {
     if (msg.type == MSG_CONTROL) {
       if (msg.payload.control.cmd == CMD_PAUSE)
@@ -156,6 +522,13 @@ int check_client_messages() {
                                    ? MODE_SUMMARY
                                    : MODE_INTERACTIVE;
       }
+      if (msg.payload.control.cmd == CMD_REQUEST_HISTOGRAM)
+        send_histogram(msg.payload.control.x, msg.payload.control.y,
+                       msg.payload.control.zoom);
+      if (msg.payload.control.cmd == CMD_SET_VIEWPORT)
+        set_viewport(&msg.payload.control);
+      if (msg.payload.control.cmd == CMD_RECONFIGURE)
+        queue_reconfig(&msg.payload.control);
       if (msg.payload.control.cmd == CMD_STOP)
         return -1;
     }
@@ -163,107 +536,515 @@ int check_client_messages() {
   return 0;
 }
 
-void send_stats_update(int repl_done, int repl_total, int final) {
+void compute_cell_estimate(const Accumulators *acc, int idx, double *avg,
+                           double *prob, double *err) {
+  int n = acc->walks_started[idx];
+  *avg = 0;
+  *prob = 0;
+  *err = 0;
+  if (n == 0)
+    return;
+
+  if (g_state.config.estimator == EST_SPLITTING) {
+    *avg = acc->est_steps_sum[idx] / n;
+    *prob = acc->est_prob_sum[idx] / n;
+    if (n > 1) {
+      double var =
+          (acc->est_prob_sq_sum[idx] / n - *prob * *prob) * n / (n - 1);
+      *err = (var > 0) ? sqrt(var / n) : 0;
+    }
+  } else {
+    *avg = (double)acc->total_steps[idx] / n;
+    *prob = (double)acc->reached_center_count[idx] / n;
+    *err = sqrt(*prob * (1 - *prob) / n);
+  }
+}
+
+void ring_init(MessageRing *ring, int capacity) {
+  ring->items = (Message *)malloc(capacity * sizeof(Message));
+  ring->capacity = capacity;
+  ring->head = 0;
+  ring->count = 0;
+  ring->dropped = 0;
+}
+
+void ring_push(MessageRing *ring, const Message *msg) {
+  if (ring->count == ring->capacity) {
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+    ring->dropped++;
+  }
+  ring->items[(ring->head + ring->count) % ring->capacity] = *msg;
+  ring->count++;
+}
+
+void ring_pop(MessageRing *ring, Message *out) {
+  *out = ring->items[ring->head];
+  ring->head = (ring->head + 1) % ring->capacity;
+  ring->count--;
+}
+
+// Only the sender thread writes to the socket. Position updates and replies
+// to client requests go to small drop-oldest rings so a slow client never
+// stalls the simulation thread; everything else is reliable and applies
+// backpressure to the reporter instead.
+void *sender_thread_func(void *arg) {
+  OutboundQueue *q = &g_state.outbound;
+  Message msg;
+  while (1) {
+    pthread_mutex_lock(&q->lock);
+    while (q->reliable.count == 0 && q->replies.count == 0 &&
+           q->state.count == 0 && !q->closed)
+      pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->reliable.count > 0) {
+      ring_pop(&q->reliable, &msg);
+      pthread_cond_signal(&q->not_full);
+    } else if (q->replies.count > 0) {
+      ring_pop(&q->replies, &msg);
+    } else if (q->state.count > 0) {
+      ring_pop(&q->state, &msg);
+    } else {
+      pthread_mutex_unlock(&q->lock);
+      break;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (send(g_state.client_socket, (char *)&msg, sizeof(msg), MSG_NOSIGNAL) <
+        0)
+      break;
+
+    pthread_mutex_lock(&q->lock);
+    q->sent++;
+    pthread_mutex_unlock(&q->lock);
+  }
+
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  q->reliable.count = 0;
+  pthread_cond_broadcast(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+void start_outbound_queue() {
+  OutboundQueue *q = &g_state.outbound;
+  ring_init(&q->reliable, RELIABLE_QUEUE_SIZE);
+  ring_init(&q->replies, REPLY_QUEUE_SIZE);
+  ring_init(&q->state, STATE_QUEUE_SIZE);
+  q->sent = 0;
+  q->closed = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  pthread_create(&q->thread, NULL, sender_thread_func, NULL);
+}
+
+void send_message(const Message *msg) {
+  OutboundQueue *q = &g_state.outbound;
+  pthread_mutex_lock(&q->lock);
+  if (msg->type == MSG_STATE_UPDATE) {
+    if (!q->closed)
+      ring_push(&q->state, msg);
+  } else {
+    while (q->reliable.count == q->reliable.capacity && !q->closed)
+      pthread_cond_wait(&q->not_full, &q->lock);
+    if (!q->closed)
+      ring_push(&q->reliable, msg);
+  }
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// For answers sent from the simulation thread: never waits for the client.
+void send_reply(const Message *msg) {
+  OutboundQueue *q = &g_state.outbound;
+  pthread_mutex_lock(&q->lock);
+  if (!q->closed)
+    ring_push(&q->replies, msg);
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+void stop_outbound_queue() {
+  OutboundQueue *q = &g_state.outbound;
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  pthread_join(q->thread, NULL);
+
+  printf("Outbound: %ld messages sent, %ld position updates dropped\n",
+         q->sent, q->state.dropped);
+
+  free(q->reliable.items);
+  free(q->replies.items);
+  free(q->state.items);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+}
+
+// Level l of the pyramid holds sums over 2^l x 2^l blocks of the per-cell
+// estimates, so a block mean is a single division. Only cells whose
+// estimate changed since the last snapshot are pushed up the levels.
+void pyramid_init(Pyramid *p) {
+  memset(p, 0, sizeof(*p));
+  int w = g_state.config.cols;
+  int h = g_state.config.rows;
+
+  while (p->num_levels < PYRAMID_MAX_LEVELS) {
+    PyramidLevel *lvl = &p->levels[p->num_levels++];
+    lvl->width = w;
+    lvl->height = h;
+    lvl->sum_avg = (double *)calloc(w * h, sizeof(double));
+    lvl->sum_prob = (double *)calloc(w * h, sizeof(double));
+    lvl->sum_err = (double *)calloc(w * h, sizeof(double));
+    lvl->valid = (int *)calloc(w * h, sizeof(int));
+    lvl->obstacles = (int *)calloc(w * h, sizeof(int));
+    lvl->cells = (int *)calloc(w * h, sizeof(int));
+    if (w == 1 && h == 1)
+      break;
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+  }
+
+  for (int y = 0; y < g_state.config.rows; y++) {
+    for (int x = 0; x < g_state.config.cols; x++) {
+      for (int l = 0; l < p->num_levels; l++) {
+        PyramidLevel *lvl = &p->levels[l];
+        int i = (y >> l) * lvl->width + (x >> l);
+        lvl->cells[i]++;
+        lvl->obstacles[i] += g_state.world.grid[get_idx(x, y)];
+      }
+    }
+  }
+}
+
+void pyramid_free(Pyramid *p) {
+  for (int l = 0; l < p->num_levels; l++) {
+    free(p->levels[l].sum_avg);
+    free(p->levels[l].sum_prob);
+    free(p->levels[l].sum_err);
+    free(p->levels[l].valid);
+    free(p->levels[l].obstacles);
+    free(p->levels[l].cells);
+  }
+  p->num_levels = 0;
+}
+
+void pyramid_set_cell(Pyramid *p, int x, int y, double avg, double prob,
+                      double err, int valid) {
+  PyramidLevel *base = &p->levels[0];
+  int i0 = y * base->width + x;
+  double d_avg = avg - base->sum_avg[i0];
+  double d_prob = prob - base->sum_prob[i0];
+  double d_err = err - base->sum_err[i0];
+  int d_valid = valid - base->valid[i0];
+
+  if (d_avg == 0 && d_prob == 0 && d_err == 0 && d_valid == 0)
+    return;
+
+  for (int l = 0; l < p->num_levels; l++) {
+    PyramidLevel *lvl = &p->levels[l];
+    int i = (y >> l) * lvl->width + (x >> l);
+    lvl->sum_avg[i] += d_avg;
+    lvl->sum_prob[i] += d_prob;
+    lvl->sum_err[i] += d_err;
+    lvl->valid[i] += d_valid;
+  }
+}
+
+void pyramid_refresh(Pyramid *p, const Accumulators *acc) {
+  for (int y = 0; y < g_state.config.rows; y++) {
+    for (int x = 0; x < g_state.config.cols; x++) {
+      int idx = get_idx(x, y);
+      int valid = acc->walks_started[idx] > 0 && !g_state.world.grid[idx];
+      double avg = 0, prob = 0, err = 0;
+      if (valid)
+        compute_cell_estimate(acc, idx, &avg, &prob, &err);
+      pyramid_set_cell(p, x, y, avg, prob, err, valid);
+    }
+  }
+}
+
+void send_stats_update(const Viewport *view, int repl_done, int repl_total,
+                       int final) {
+  Pyramid *p = &g_state.reporter.pyramid;
+  int zoom = view->zoom;
+  if (zoom < 0)
+    zoom = 0;
+  if (zoom >= p->num_levels)
+    zoom = p->num_levels - 1;
+  PyramidLevel *lvl = &p->levels[zoom];
+
   StatsUpdateMsg stats;
   stats.total_replications_done = repl_done;
   stats.total_replications_target = repl_total;
   stats.final_update = final;
+  stats.zoom = zoom;
   stats.num_cells = 0;
 
+  SharedStats *shm = g_state.shared_stats;
+  if (shm) {
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->num_cells = 0;
+  }
+
   Message msg;
   msg.type = MSG_STATS_UPDATE;
 
-  for (int y = 0; y < g_state.config.rows; y++) {
-    for (int x = 0; x < g_state.config.cols; x++) {
-      int idx = get_idx(x, y);
+  int x0 = (view->x > 0) ? view->x : 0;
+  int y0 = (view->y > 0) ? view->y : 0;
+  int x1 = view->x + view->width;
+  int y1 = view->y + view->height;
+  if (x1 > lvl->width)
+    x1 = lvl->width;
+  if (y1 > lvl->height)
+    y1 = lvl->height;
+
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      int i = y * lvl->width + x;
+      int n = lvl->valid[i];
       CellStats cs;
       cs.x = x;
       cs.y = y;
-      cs.is_obstacle = g_state.world.grid[idx];
-
-      int n = g_state.world.walks_started[idx];
-      cs.avg_steps_to_center =
-          (n > 0) ? (float)g_state.world.total_steps[idx] / n : 0;
-      cs.prob_reach_center_k =
-          (n > 0) ? (float)g_state.world.reached_center_count[idx] / n : 0;
+      cs.is_obstacle = (lvl->obstacles[i] == lvl->cells[i]);
+      cs.avg_steps_to_center = (n > 0) ? (float)(lvl->sum_avg[i] / n) : 0;
+      cs.prob_reach_center_k = (n > 0) ? (float)(lvl->sum_prob[i] / n) : 0;
+      cs.prob_std_error = (n > 0) ? (float)(lvl->sum_err[i] / n) : 0;
 
+      if (shm) {
+        shm->cells[shm->num_cells++] = cs;
+        continue;
+      }
       stats.cells[stats.num_cells++] = cs;
 
       if (stats.num_cells >= STATS_CHUNK_SIZE) {
         msg.payload.stats = stats;
-        send(g_state.client_socket, (char *)&msg, sizeof(msg), 0);
+        send_message(&msg);
         stats.num_cells = 0;
       }
     }
   }
-  if (stats.num_cells > 0) {
+  if (shm) {
+    shm->zoom = zoom;
+    shm->total_replications_done = repl_done;
+    shm->total_replications_target = repl_total;
+    shm->final_update = final;
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+    return;
+  }
+  if (stats.num_cells > 0 || final) {
     msg.payload.stats = stats;
-    send(g_state.client_socket, (char *)&msg, sizeof(msg), 0);
+    send_message(&msg);
   }
 }
 
-void run_walk(int start_x, int start_y, int repl_id) {
-  int x = start_x;
-  int y = start_y;
-  int steps = 0;
+// (x, y) is a tile at the given zoom level. Histograms are plain counts, so
+// the tile's histogram is the sum over the cells it covers.
+void send_histogram(int x, int y, int zoom) {
+  if (zoom < 0 || zoom >= PYRAMID_MAX_LEVELS)
+    return;
+  int x0 = x << zoom;
+  int y0 = y << zoom;
+  if (x0 < 0 || x0 >= g_state.config.cols || y0 < 0 ||
+      y0 >= g_state.config.rows)
+    return;
+  int x1 = (x + 1) << zoom;
+  int y1 = (y + 1) << zoom;
+  if (x1 > g_state.config.cols)
+    x1 = g_state.config.cols;
+  if (y1 > g_state.config.rows)
+    y1 = g_state.config.rows;
 
-  if (g_state.world.grid[get_idx(x, y)] == 1)
+  Message msg;
+  msg.type = MSG_HISTOGRAM;
+  HistogramMsg *h = &msg.payload.histogram;
+  memset(h->buckets, 0, sizeof(h->buckets));
+  for (int cy = y0; cy < y1; cy++) {
+    for (int cx = x0; cx < x1; cx++) {
+      const unsigned int *buckets =
+          &g_state.world.acc.hist[get_idx(cx, cy) * HIST_BUCKETS];
+      for (int b = 0; b < HIST_BUCKETS; b++)
+        h->buckets[b] += buckets[b];
+    }
+  }
+
+  h->x = x0;
+  h->y = y0;
+  h->width = x1 - x0;
+  h->height = y1 - y0;
+  h->samples = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    h->bucket_lower[b] = hist_bucket_lower(b);
+    h->samples += h->buckets[b];
+  }
+  h->median_steps = (float)hist_quantile(h->buckets, 0.5);
+  h->p95_steps = (float)hist_quantile(h->buckets, 0.95);
+  send_reply(&msg);
+}
+
+// Without arrays only the progress counters go out, as a single message with
+// no cells; the full accumulators follow every SHARD_INTERVAL_MS and at the end.
+void send_shard_result(const StatsSnapshot *snap, int with_arrays) {
+  int size = g_state.config.rows * g_state.config.cols;
+  Message msg;
+  msg.type = MSG_SHARD_RESULT;
+  ShardResultMsg *res = &msg.payload.shard_result;
+  res->shard_id = g_state.shard_id;
+  res->replications_done = snap->repl_done;
+  res->final_update = snap->final;
+
+  if (!with_arrays) {
+    res->offset = 0;
+    res->num_cells = 0;
+    res->last_chunk = 1;
+    send_message(&msg);
     return;
+  }
+
+  for (int offset = 0; offset < size; offset += SHARD_CHUNK_SIZE) {
+    int n = size - offset;
+    if (n > SHARD_CHUNK_SIZE)
+      n = SHARD_CHUNK_SIZE;
+    res->offset = offset;
+    res->num_cells = n;
+    res->last_chunk = (offset + n >= size);
+    memcpy(res->total_steps, snap->acc.total_steps + offset, n * sizeof(long));
+    memcpy(res->reached_center_count, snap->acc.reached_center_count + offset,
+           n * sizeof(int));
+    memcpy(res->walks_started, snap->acc.walks_started + offset,
+           n * sizeof(int));
+    memcpy(res->est_prob_sum, snap->acc.est_prob_sum + offset,
+           n * sizeof(double));
+    memcpy(res->est_prob_sq_sum, snap->acc.est_prob_sq_sum + offset,
+           n * sizeof(double));
+    memcpy(res->est_steps_sum, snap->acc.est_steps_sum + offset,
+           n * sizeof(double));
+    memcpy(res->hist, snap->acc.hist + offset * HIST_BUCKETS,
+           n * HIST_BUCKETS * sizeof(unsigned int));
+    send_message(&msg);
+  }
+}
+
+void open_trajectory_file() {
+  if (g_state.config.record_count <= 0 ||
+      g_state.config.estimator != EST_PLAIN)
+    return;
+
+  // Every configuration of a session gets its own file, so a reconfigure
+  // never overwrites the walks recorded before it.
+  char shard[16] = "";
+  char suffix[16] = "";
+  if (g_state.role == ROLE_WORKER)
+    snprintf(shard, sizeof(shard), ".%d", g_state.shard_id);
+  if (g_state.traj_config > 0)
+    snprintf(suffix, sizeof(suffix), ".cfg%d", g_state.traj_config);
+
+  char filename[MAX_FILENAME + 48];
+  snprintf(filename, sizeof(filename), "%s%s%s.traj",
+           g_state.config.save_filename, shard, suffix);
+
+  g_state.traj_file = fopen(filename, "wb");
+  if (!g_state.traj_file) {
+    perror("trajectory file");
+    return;
+  }
+  g_state.traj_moves = (unsigned char *)malloc(
+      g_state.config.max_steps_k / TRAJ_MOVES_PER_BYTE + 1);
+
+  TrajFileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = TRAJ_MAGIC;
+  header.version = TRAJ_VERSION;
+  header.rows = g_state.config.rows;
+  header.cols = g_state.config.cols;
+  header.max_steps_k = g_state.config.max_steps_k;
+  header.use_obstacles = g_state.config.use_obstacles;
+  header.prob_up = g_state.config.prob_up;
+  header.prob_down = g_state.config.prob_down;
+  header.prob_left = g_state.config.prob_left;
+  header.prob_right = g_state.config.prob_right;
+  fwrite(&header, sizeof(header), 1, g_state.traj_file);
+
+  for (int y = 0; y < g_state.config.rows; y++) {
+    for (int x = 0; x < g_state.config.cols; x++) {
+      unsigned char cell = (unsigned char)g_state.world.grid[get_idx(x, y)];
+      fwrite(&cell, 1, 1, g_state.traj_file);
+    }
+  }
+}
+
+void close_trajectory_file() {
+  if (g_state.traj_file)
+    fclose(g_state.traj_file);
+  if (g_state.traj_moves)
+    free(g_state.traj_moves);
+  g_state.traj_file = NULL;
+  g_state.traj_moves = NULL;
+}
+
+int is_recorded_replication(int repl_id) {
+  return g_state.traj_file && repl_id >= g_state.config.record_first_repl &&
+         repl_id < g_state.config.record_first_repl + g_state.config.record_count;
+}
+
+void write_trajectory(int repl_id, int start_x, int start_y, int steps,
+                      int reached) {
+  TrajRecordHeader rec;
+  rec.replication_id = repl_id;
+  rec.start_x = start_x;
+  rec.start_y = start_y;
+  rec.seed = g_state.seed;
+  rec.num_steps = steps;
+  rec.reached_center = reached;
+  fwrite(&rec, sizeof(rec), 1, g_state.traj_file);
+  fwrite(g_state.traj_moves, 1,
+         (steps + TRAJ_MOVES_PER_BYTE - 1) / TRAJ_MOVES_PER_BYTE,
+         g_state.traj_file);
+}
+
+// Walks from (x, y) with `steps` already taken, crediting the result to the
+// start cell. Returns the cell index the walker is left on when K runs out,
+// -1 if it reached the center (or could not start), -2 on CMD_STOP.
+// A negative repl_id continues a retained walk: no display, no recording.
+int run_walk_from(int start_x, int start_y, int x, int y, int steps,
+                  int repl_id) {
+  int reached = 0;
+  int recording = is_recorded_replication(repl_id);
+
+  if (g_state.world.grid[get_idx(x, y)] == 1)
+    return -1;
 
   while (steps < g_state.config.max_steps_k) {
     while (g_state.paused) {
       if (check_client_messages() == -1)
-        return;
+        return -2;
       usleep(100000);
     }
     if (check_client_messages() == -1)
-      return;
+      return -2;
 
     if (x == 0 && y == 0) {
-      g_state.world.total_steps[get_idx(start_x, start_y)] += steps;
-      g_state.world.reached_center_count[get_idx(start_x, start_y)]++;
+      g_state.world.acc.total_steps[get_idx(start_x, start_y)] += steps;
+      g_state.world.acc.reached_center_count[get_idx(start_x, start_y)]++;
+      g_state.world.acc
+          .hist[get_idx(start_x, start_y) * HIST_BUCKETS + hist_bucket(steps)]++;
+      reached = 1;
       break;
     }
 
-    float r = (float)rand() / RAND_MAX;
-    int next_x = x;
-    int next_y = y;
-
-    if (r < g_state.config.prob_up)
-      next_y--;
-    else if (r < g_state.config.prob_up + g_state.config.prob_down)
-      next_y++;
-    else if (r < g_state.config.prob_up + g_state.config.prob_down +
-                     g_state.config.prob_left)
-      next_x--;
-    else
-      next_x++;
-
-    if (g_state.config.use_obstacles == 0) {
-      if (next_x < 0)
-        next_x = g_state.config.cols - 1;
-      if (next_x >= g_state.config.cols)
-        next_x = 0;
-      if (next_y < 0)
-        next_y = g_state.config.rows - 1;
-      if (next_y >= g_state.config.rows)
-        next_y = 0;
-    } else {
-      if (next_x < 0 || next_x >= g_state.config.cols || next_y < 0 ||
-          next_y >= g_state.config.rows) {
-        next_x = x;
-        next_y = y;
-      } else if (g_state.world.grid[get_idx(next_x, next_y)] == 1) {
-        next_x = x;
-        next_y = y;
-      }
+    int dir = step_walker(&x, &y);
+    if (recording) {
+      int shift = (steps % TRAJ_MOVES_PER_BYTE) * 2;
+      unsigned char *byte = &g_state.traj_moves[steps / TRAJ_MOVES_PER_BYTE];
+      *byte = (shift == 0) ? dir : (*byte | (dir << shift));
     }
-
-    x = next_x;
-    y = next_y;
     steps++;
 
-    if (g_state.current_mode == MODE_INTERACTIVE) {
+    if (repl_id >= 0 && g_state.current_mode == MODE_INTERACTIVE) {
       Message msg;
       msg.type = MSG_STATE_UPDATE;
       msg.payload.state.pos.x = x;
@@ -271,21 +1052,128 @@ void run_walk(int start_x, int start_y, int repl_id) {
       msg.payload.state.step_count = steps;
       msg.payload.state.replication_id = repl_id;
       msg.payload.state.total_replications = g_state.config.replications;
-      send(g_state.client_socket, (char *)&msg, sizeof(msg), 0);
+      send_message(&msg);
       usleep(10000);
     }
   }
+
+  if (recording)
+    write_trajectory(repl_id, start_x, start_y, steps, reached);
+  return reached ? -1 : get_idx(x, y);
+}
+
+void retain_alive_walk(int start_idx, int end_idx) {
+  World *w = &g_state.world;
+  if (!w->alive_complete)
+    return;
+  if (w->alive_total >= MAX_RETAINED_WALKS) {
+    w->alive_complete = 0;
+    return;
+  }
+
+  AliveList *list = &w->alive[start_idx];
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 16;
+    list->pos = (unsigned short *)realloc(
+        list->pos, list->capacity * sizeof(unsigned short));
+  }
+  list->pos[list->count++] = (unsigned short)end_idx;
+  w->alive_total++;
+}
+
+int run_walk(int start_x, int start_y, int repl_id) {
+  int end = run_walk_from(start_x, start_y, start_x, start_y, 0, repl_id);
+  if (end >= 0)
+    retain_alive_walk(get_idx(start_x, start_y), end);
+  return end;
+}
+
+// Fixed-effort multilevel splitting on the BFS distance to (0,0). The product
+// of per-level survival fractions is an unbiased estimate of the reach
+// probability; one call yields one estimate per replication.
+int run_splitting(int start_x, int start_y, double *prob_out,
+                  double *steps_out) {
+  unsigned int *hist =
+      &g_state.world.acc.hist[get_idx(start_x, start_y) * HIST_BUCKETS];
+  int n = g_state.config.splitting_particles;
+  int limit = g_state.config.max_steps_k - 1;
+  int *dist = g_state.world.dist_to_center;
+  int d0 = dist[get_idx(start_x, start_y)];
+
+  *prob_out = 0;
+  *steps_out = 0;
+  if (d0 < 0 || d0 > limit)
+    return 0;
+
+  Particle *cur = (Particle *)malloc(n * sizeof(Particle));
+  Particle *hits = (Particle *)malloc(n * sizeof(Particle));
+  for (int i = 0; i < n; i++)
+    cur[i] = (Particle){start_x, start_y, 0};
+
+  double prob = 1.0;
+  for (int level = d0 - 1; level >= 0; level--) {
+    while (g_state.paused) {
+      if (check_client_messages() == -1)
+        goto stopped;
+      usleep(100000);
+    }
+    if (check_client_messages() == -1)
+      goto stopped;
+
+    int n_hits = 0;
+    for (int i = 0; i < n; i++) {
+      Particle p = cur[i];
+      int d = dist[get_idx(p.x, p.y)];
+      while (d > level && p.steps + d <= limit) {
+        step_walker(&p.x, &p.y);
+        p.steps++;
+        d = dist[get_idx(p.x, p.y)];
+      }
+      if (d <= level)
+        hits[n_hits++] = p;
+    }
+
+    if (n_hits == 0) {
+      prob = 0;
+      break;
+    }
+    prob *= (double)n_hits / n;
+
+    if (level == 0) {
+      double steps_sum = 0;
+      for (int i = 0; i < n_hits; i++) {
+        steps_sum += hits[i].steps;
+        hist[hist_bucket(hits[i].steps)]++;
+      }
+      *steps_out = prob * steps_sum / n_hits;
+      break;
+    }
+
+    for (int i = 0; i < n; i++)
+      cur[i] = hits[rand() % n_hits];
+  }
+
+  *prob_out = prob;
+  free(cur);
+  free(hits);
+  return 0;
+
+stopped:
+  free(cur);
+  free(hits);
+  return -1;
 }
 
-void save_results_to_file() {
+// K and the probabilities come from the snapshot: the simulation thread may
+// already be applying a reconfiguration while this runs.
+void save_results_to_file(const StatsSnapshot *snap) {
+  const Accumulators *acc = &snap->acc;
   printf("Saving results to %s\n", g_state.config.save_filename);
   FILE *f = fopen(g_state.config.save_filename, "w");
   if (f) {
     fprintf(f, "# Params: R=%d, C=%d, K=%d, Prob=%.2f/%.2f/%.2f/%.2f\n",
-            g_state.config.rows, g_state.config.cols,
-            g_state.config.max_steps_k, g_state.config.prob_up,
-            g_state.config.prob_down, g_state.config.prob_left,
-            g_state.config.prob_right);
+            g_state.config.rows, g_state.config.cols, snap->max_steps_k,
+            snap->prob_up, snap->prob_down, snap->prob_left, snap->prob_right);
 
     fprintf(f, "# Map:\n");
     for (int y = 0; y < g_state.config.rows; y++) {
@@ -295,106 +1183,650 @@ void save_results_to_file() {
       fprintf(f, "\n");
     }
 
-    fprintf(f, "X,Y,AvgSteps,ProbReachK\n");
+    fprintf(f, "# Estimator: %d/%d\n", g_state.config.estimator,
+            g_state.config.splitting_particles);
+
+    fprintf(f, "X,Y,AvgSteps,ProbReachK,ProbStdErr,MedianSteps,P95Steps\n");
     for (int y = 0; y < g_state.config.rows; y++) {
       for (int x = 0; x < g_state.config.cols; x++) {
         int idx = get_idx(x, y);
-        int n = g_state.world.walks_started[idx];
-        double avg = (n > 0) ? (double)g_state.world.total_steps[idx] / n : 0;
-        double prob =
-            (n > 0) ? (double)g_state.world.reached_center_count[idx] / n : 0;
-        fprintf(f, "%d,%d,%.2f,%.2f\n", x, y, avg, prob);
+        double avg, prob, err;
+        compute_cell_estimate(acc, idx, &avg, &prob, &err);
+        const unsigned int *buckets = &acc->hist[idx * HIST_BUCKETS];
+        char median[16], p95[16];
+        format_steps(median, sizeof(median), hist_quantile(buckets, 0.5));
+        format_steps(p95, sizeof(p95), hist_quantile(buckets, 0.95));
+        fprintf(f, "%d,%d,%.2f,%.6g,%.6g,%s,%s\n", x, y, avg, prob, err, median,
+                p95);
+      }
+    }
+    fclose(f);
+  }
+
+  char hist_filename[MAX_FILENAME + 16];
+  snprintf(hist_filename, sizeof(hist_filename), "%s.hist.csv",
+           g_state.config.save_filename);
+  f = fopen(hist_filename, "w");
+  if (f) {
+    fprintf(f, "X,Y,BucketLower,Count\n");
+    for (int y = 0; y < g_state.config.rows; y++) {
+      for (int x = 0; x < g_state.config.cols; x++) {
+        const unsigned int *buckets = &acc->hist[get_idx(x, y) * HIST_BUCKETS];
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+          if (buckets[b] > 0)
+            fprintf(f, "%d,%d,%d,%u\n", x, y, hist_bucket_lower(b), buckets[b]);
+        }
       }
     }
     fclose(f);
   }
 }
 
-void simulation_loop() {
+long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// The simulation only copies its accumulators into whichever slot the
+// reporter is not currently encoding; the reporter thread does the float
+// conversion, the socket writes and the final CSV on its own time.
+void *reporter_thread_func(void *arg) {
+  Reporter *rep = &g_state.reporter;
+  while (1) {
+    pthread_mutex_lock(&rep->lock);
+    while (rep->ready == -1 && !rep->view_changed && !rep->done)
+      pthread_cond_wait(&rep->cond, &rep->lock);
+    Viewport view = rep->view;
+    rep->view_changed = 0;
+    if (rep->ready == -1) {
+      int done = rep->done;
+      pthread_mutex_unlock(&rep->lock);
+      if (done)
+        break;
+      send_stats_update(&view, rep->last_repl_done, rep->last_repl_total, 0);
+      continue;
+    }
+    rep->sending = rep->ready;
+    rep->ready = -1;
+    pthread_mutex_unlock(&rep->lock);
+
+    StatsSnapshot *snap = &rep->slots[rep->sending];
+    int final = snap->final;
+    if (g_state.role == ROLE_WORKER) {
+      int with_arrays = final || now_ms() >= rep->next_shard_arrays;
+      if (with_arrays)
+        rep->next_shard_arrays = now_ms() + SHARD_INTERVAL_MS;
+      send_shard_result(snap, with_arrays);
+    } else {
+      if (final)
+        save_results_to_file(snap);
+      pyramid_refresh(&rep->pyramid, &snap->acc);
+      rep->last_repl_done = snap->repl_done;
+      rep->last_repl_total = snap->repl_total;
+      send_stats_update(&view, snap->repl_done, snap->repl_total, final);
+    }
+
+    pthread_mutex_lock(&rep->lock);
+    rep->sending = -1;
+    pthread_mutex_unlock(&rep->lock);
+
+    if (final) {
+      Message end_msg;
+      end_msg.type = MSG_GAME_OVER;
+      snprintf(end_msg.payload.game_over_msg,
+               sizeof(end_msg.payload.game_over_msg), "Done. Results saved.");
+      send_message(&end_msg);
+    }
+  }
+  return NULL;
+}
+
+void start_reporter() {
+  Reporter *rep = &g_state.reporter;
+  int size = g_state.config.rows * g_state.config.cols;
+  alloc_accumulators(&rep->slots[0].acc, size);
+  alloc_accumulators(&rep->slots[1].acc, size);
+  rep->ready = -1;
+  rep->sending = -1;
+  rep->done = 0;
+  rep->view = (Viewport){0, 0, g_state.config.cols, g_state.config.rows, 0};
+  rep->view_changed = 0;
+  rep->last_repl_done = 0;
+  rep->last_repl_total = g_state.config.replications;
+  rep->next_shard_arrays = now_ms() + SHARD_INTERVAL_MS;
+  if (g_state.role != ROLE_WORKER)
+    pyramid_init(&rep->pyramid);
+  pthread_mutex_init(&rep->lock, NULL);
+  pthread_cond_init(&rep->cond, NULL);
+  pthread_create(&rep->thread, NULL, reporter_thread_func, NULL);
+}
+
+void publish_snapshot(int repl_done, int final) {
+  Reporter *rep = &g_state.reporter;
+  pthread_mutex_lock(&rep->lock);
+  int slot = (rep->sending == 0) ? 1 : 0;
+  StatsSnapshot *snap = &rep->slots[slot];
+  copy_accumulators(&snap->acc, &g_state.world.acc,
+                    g_state.config.rows * g_state.config.cols);
+  snap->repl_done = repl_done;
+  snap->repl_total = g_state.config.replications;
+  snap->final = final;
+  snap->max_steps_k = g_state.config.max_steps_k;
+  snap->prob_up = g_state.config.prob_up;
+  snap->prob_down = g_state.config.prob_down;
+  snap->prob_left = g_state.config.prob_left;
+  snap->prob_right = g_state.config.prob_right;
+  rep->ready = slot;
+  pthread_cond_signal(&rep->cond);
+  pthread_mutex_unlock(&rep->lock);
+}
+
+void set_viewport(const ControlMsg *ctl) {
+  Reporter *rep = &g_state.reporter;
+  pthread_mutex_lock(&rep->lock);
+  rep->view = (Viewport){ctl->x, ctl->y, ctl->width, ctl->height, ctl->zoom};
+  rep->view_changed = 1;
+  pthread_cond_signal(&rep->cond);
+  pthread_mutex_unlock(&rep->lock);
+}
+
+void stop_reporter() {
+  Reporter *rep = &g_state.reporter;
+  pthread_mutex_lock(&rep->lock);
+  rep->done = 1;
+  pthread_cond_signal(&rep->cond);
+  pthread_mutex_unlock(&rep->lock);
+  pthread_join(rep->thread, NULL);
+  pyramid_free(&rep->pyramid);
+  pthread_mutex_destroy(&rep->lock);
+  pthread_cond_destroy(&rep->cond);
+}
+
+// Walks that timed out at the old K resume from where they stopped, so
+// raising K only costs the extra steps of the walks still alive.
+int extend_alive_walks(int old_k) {
+  World *w = &g_state.world;
+  int size = g_state.config.rows * g_state.config.cols;
+
+  for (int idx = 0; idx < size; idx++) {
+    AliveList *list = &w->alive[idx];
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+      int pos = list->pos[i];
+      int end = run_walk_from(idx % g_state.config.cols,
+                              idx / g_state.config.cols,
+                              pos % g_state.config.cols,
+                              pos / g_state.config.cols, old_k, -1);
+      if (end == -2)
+        return -1;
+      if (end >= 0)
+        list->pos[kept++] = (unsigned short)end;
+    }
+    w->alive_total -= list->count - kept;
+    list->count = kept;
+  }
+  return 0;
+}
+
+void reset_accumulators() {
+  World *w = &g_state.world;
+  int size = g_state.config.rows * g_state.config.cols;
+  Accumulators *acc = &w->acc;
+
+  memset(acc->total_steps, 0, size * sizeof(long));
+  memset(acc->reached_center_count, 0, size * sizeof(int));
+  memset(acc->walks_started, 0, size * sizeof(int));
+  memset(acc->est_prob_sum, 0, size * sizeof(double));
+  memset(acc->est_prob_sq_sum, 0, size * sizeof(double));
+  memset(acc->est_steps_sum, 0, size * sizeof(double));
+  memset(acc->hist, 0, size * HIST_BUCKETS * sizeof(unsigned int));
+
+  for (int i = 0; i < size; i++)
+    w->alive[i].count = 0;
+  w->alive_total = 0;
+  w->alive_complete = 1;
+}
+
+// Applies a CMD_RECONFIGURE. The world, its obstacle map and the distance
+// field are kept. Returns 1 if the accumulators had to be reset and the
+// replications must start over, 0 if the results carry over, -1 on stop.
+int apply_reconfig(const ControlMsg *ctl) {
+  ConfigMsg *cfg = &g_state.config;
+  int old_k = cfg->max_steps_k;
+  int same_probs =
+      ctl->prob_up == cfg->prob_up && ctl->prob_down == cfg->prob_down &&
+      ctl->prob_left == cfg->prob_left && ctl->prob_right == cfg->prob_right;
+
+  if (ctl->max_steps_k <= 0)
+    return 0;
+  if (same_probs && ctl->max_steps_k == old_k)
+    return 0;
+
+  cfg->max_steps_k = ctl->max_steps_k;
+  cfg->prob_up = ctl->prob_up;
+  cfg->prob_down = ctl->prob_down;
+  cfg->prob_left = ctl->prob_left;
+  cfg->prob_right = ctl->prob_right;
+
+  close_trajectory_file();
+  g_state.traj_config++;
+  open_trajectory_file();
+
+  if (same_probs && cfg->max_steps_k > old_k &&
+      cfg->estimator == EST_PLAIN && g_state.world.alive_complete)
+    return extend_alive_walks(old_k);
+
+  reset_accumulators();
+  return 1;
+}
+
+// Returns 0 when all replications are done, 1 if a reconfiguration reset
+// the accumulators part-way through, -1 on stop.
+int run_replications() {
+  long next_publish = now_ms() + STATS_INTERVAL_MS;
+
   for (int r = 0; r < g_state.config.replications; r++) {
     for (int y = 0; y < g_state.config.rows; y++) {
       for (int x = 0; x < g_state.config.cols; x++) {
         if (x == 0 && y == 0)
           continue;
 
-        g_state.world.walks_started[get_idx(x, y)]++;
-        run_walk(x, y, r);
+        int idx = get_idx(x, y);
+        g_state.world.acc.walks_started[idx]++;
+        if (g_state.config.estimator == EST_SPLITTING) {
+          double prob, steps;
+          if (run_splitting(x, y, &prob, &steps) == -1)
+            return -1;
+          g_state.world.acc.est_prob_sum[idx] += prob;
+          g_state.world.acc.est_prob_sq_sum[idx] += prob * prob;
+          g_state.world.acc.est_steps_sum[idx] += steps;
+        } else if (run_walk(x, y, g_state.first_replication + r) == -2) {
+          return -1;
+        }
 
         if (check_client_messages() == -1)
-          return;
+          return -1;
+
+        if (g_state.reconfig_pending) {
+          g_state.reconfig_pending = 0;
+          int rc = apply_reconfig(&g_state.reconfig);
+          if (rc != 0)
+            return rc;
+        }
+
+        if ((g_state.current_mode == MODE_SUMMARY ||
+             g_state.config.estimator == EST_SPLITTING) &&
+            now_ms() >= next_publish) {
+          publish_snapshot(r, 0);
+          next_publish = now_ms() + STATS_INTERVAL_MS;
+        }
       }
     }
+  }
+  return 0;
+}
+
+int wait_for_reconfig() {
+  while (1) {
+    if (check_client_messages() == -1)
+      return -1;
+    if (g_state.reconfig_pending) {
+      g_state.reconfig_pending = 0;
+      return apply_reconfig(&g_state.reconfig);
+    }
+    usleep(50000);
+  }
+}
+
+// After the last replication the session stays open, so the client can
+// change K or the probabilities and get updated results without a restart.
+void simulation_loop() {
+  int rc = 1;
+  while (rc != -1) {
+    if (rc == 1)
+      rc = run_replications();
+    if (rc == 0) {
+      publish_snapshot(g_state.config.replications, 1);
+      rc = wait_for_reconfig();
+    }
+  }
+}
+
+SOCKET connect_to_worker(const char *spec) {
+  char host[256];
+  const char *colon = strrchr(spec, ':');
+  if (!colon || colon - spec >= (long)sizeof(host))
+    return INVALID_SOCKET;
+  memcpy(host, spec, colon - spec);
+  host[colon - spec] = '\0';
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+    return INVALID_SOCKET;
+
+  SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET ||
+      connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+    if (sock != INVALID_SOCKET)
+      CLOSE_SOCKET(sock);
+    sock = INVALID_SOCKET;
+  }
+  freeaddrinfo(res);
+  return sock;
+}
+
+int connect_workers(const char *specs) {
+  char *list = strdup(specs);
+  int count = 1;
+  for (const char *p = specs; *p; p++)
+    if (*p == ',')
+      count++;
+
+  g_state.workers = (WorkerLink *)calloc(count, sizeof(WorkerLink));
+  g_state.num_workers = 0;
+  int size = g_state.config.rows * g_state.config.cols;
+
+  for (char *spec = strtok(list, ","); spec; spec = strtok(NULL, ",")) {
+    SOCKET sock = connect_to_worker(spec);
+    if (sock == INVALID_SOCKET) {
+      // Release the workers that did connect so they are not left waiting
+      // for a shard, and tell the client the run will not be distributed.
+      Message err;
+      err.type = MSG_ERROR;
+      snprintf(err.payload.error_msg, sizeof(err.payload.error_msg),
+               "Could not connect to worker %s, running locally", spec);
+      send(g_state.client_socket, (char *)&err, sizeof(err), MSG_NOSIGNAL);
+      disconnect_workers();
+      free(list);
+      return -1;
+    }
+    WorkerLink *w = &g_state.workers[g_state.num_workers++];
+    w->sock = sock;
+    alloc_accumulators(&w->acc, size);
+    alloc_accumulators(&w->incoming, size);
+  }
+  free(list);
+  return 0;
+}
+
+void send_to_workers(ControlCommand cmd) {
+  Message msg;
+  msg.type = MSG_CONTROL;
+  msg.payload.control.cmd = cmd;
+  for (int i = 0; i < g_state.num_workers; i++)
+    send(g_state.workers[i].sock, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
+}
 
-    if (g_state.current_mode == MODE_SUMMARY) {
-      if (r % 5 == 0 || r == g_state.config.replications - 1) {
-        send_stats_update(r, g_state.config.replications, 0);
+// Swaps in a worker's completed snapshot, replacing its previous
+// contribution to the merged accumulators in one pass over the grid.
+void merge_worker_results(WorkerLink *w) {
+  int size = g_state.config.rows * g_state.config.cols;
+  Accumulators *acc = &g_state.world.acc;
+  Accumulators *old = &w->acc;
+  Accumulators *cur = &w->incoming;
+
+  for (int i = 0; i < size; i++) {
+    acc->total_steps[i] += cur->total_steps[i] - old->total_steps[i];
+    acc->reached_center_count[i] +=
+        cur->reached_center_count[i] - old->reached_center_count[i];
+    acc->walks_started[i] += cur->walks_started[i] - old->walks_started[i];
+    acc->est_prob_sum[i] += cur->est_prob_sum[i] - old->est_prob_sum[i];
+    acc->est_prob_sq_sum[i] +=
+        cur->est_prob_sq_sum[i] - old->est_prob_sq_sum[i];
+    acc->est_steps_sum[i] += cur->est_steps_sum[i] - old->est_steps_sum[i];
+  }
+  for (int i = 0; i < size * HIST_BUCKETS; i++)
+    acc->hist[i] += cur->hist[i] - old->hist[i];
+
+  Accumulators tmp = w->acc;
+  w->acc = w->incoming;
+  w->incoming = tmp;
+}
+
+// Splits the replications into one shard per worker, each with its own seed
+// and the coordinator's obstacle map, then merges the raw accumulators the
+// workers stream back and republishes them to the client as usual.
+void coordinator_loop() {
+  unsigned int base_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+  int n = g_state.num_workers;
+  int first_replication = 0;
+
+  for (int i = 0; i < n; i++) {
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_SHARD;
+    ShardMsg *shard = &msg.payload.shard;
+    shard->config = g_state.config;
+    shard->config.replications =
+        g_state.config.replications / n + (i < g_state.config.replications % n);
+    shard->config.initial_mode = MODE_SUMMARY;
+    if (g_state.config.use_obstacles != 0) {
+      shard->config.use_obstacles = 2;
+      for (int y = 0; y < g_state.config.rows; y++)
+        for (int x = 0; x < g_state.config.cols; x++)
+          shard->config.obstacle_map[x][y] = g_state.world.grid[get_idx(x, y)];
+    }
+    shard->shard_id = i;
+    shard->seed = base_seed + i * 2654435761u;
+    shard->first_replication = first_replication;
+    first_replication += shard->config.replications;
+    send(g_state.workers[i].sock, (char *)&msg, sizeof(msg), MSG_NOSIGNAL);
+  }
+
+  int finished = 0;
+  int was_paused = 0;
+  int dirty = 0;
+  long next_publish = now_ms() + STATS_INTERVAL_MS;
+  while (finished < n) {
+    if (check_client_messages() == -1) {
+      send_to_workers(CMD_STOP);
+      return;
+    }
+    if (g_state.paused != was_paused) {
+      was_paused = g_state.paused;
+      send_to_workers(was_paused ? CMD_PAUSE : CMD_RESUME);
+    }
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    SOCKET max_fd = 0;
+    for (int i = 0; i < n; i++) {
+      if (g_state.workers[i].final)
+        continue;
+      FD_SET(g_state.workers[i].sock, &fds);
+      if (g_state.workers[i].sock > max_fd)
+        max_fd = g_state.workers[i].sock;
+    }
+    if (dirty && now_ms() >= next_publish) {
+      int repl_done = 0;
+      for (int i = 0; i < n; i++)
+        repl_done += g_state.workers[i].repl_done;
+      publish_snapshot(repl_done, 0);
+      dirty = 0;
+      next_publish = now_ms() + STATS_INTERVAL_MS;
+    }
+
+    struct timeval tv = {0, 100000};
+    if (select(max_fd + 1, &fds, NULL, NULL, &tv) <= 0)
+      continue;
+
+    for (int i = 0; i < n; i++) {
+      WorkerLink *w = &g_state.workers[i];
+      if (w->final || !FD_ISSET(w->sock, &fds))
+        continue;
+
+      Message msg;
+      if (recv(w->sock, (char *)&msg, sizeof(msg), MSG_WAITALL) !=
+          sizeof(msg)) {
+        fprintf(stderr, "Lost connection to worker %d\n", i);
+        send_to_workers(CMD_STOP);
+        return;
+      }
+      if (msg.type != MSG_SHARD_RESULT)
+        continue;
+
+      ShardResultMsg *res = &msg.payload.shard_result;
+      int off = res->offset;
+      int cnt = res->num_cells;
+      Accumulators *in = &w->incoming;
+      memcpy(in->total_steps + off, res->total_steps, cnt * sizeof(long));
+      memcpy(in->reached_center_count + off, res->reached_center_count,
+             cnt * sizeof(int));
+      memcpy(in->walks_started + off, res->walks_started, cnt * sizeof(int));
+      memcpy(in->est_prob_sum + off, res->est_prob_sum, cnt * sizeof(double));
+      memcpy(in->est_prob_sq_sum + off, res->est_prob_sq_sum,
+             cnt * sizeof(double));
+      memcpy(in->est_steps_sum + off, res->est_steps_sum,
+             cnt * sizeof(double));
+      memcpy(in->hist + off * HIST_BUCKETS, res->hist,
+             cnt * HIST_BUCKETS * sizeof(unsigned int));
+
+      if (res->last_chunk) {
+        if (cnt > 0)
+          merge_worker_results(w);
+        w->repl_done = res->replications_done;
+        if (res->final_update) {
+          w->final = 1;
+          finished++;
+        }
+        dirty = 1;
       }
-    } else {
     }
   }
 
-  save_results_to_file();
+  int repl_done = 0;
+  for (int i = 0; i < n; i++)
+    repl_done += g_state.workers[i].repl_done;
+  publish_snapshot(repl_done, 1);
+}
+
+void run_session(const Message *msg) {
+  if (g_state.role == ROLE_WORKER) {
+    g_state.config = msg->payload.shard.config;
+    g_state.shard_id = msg->payload.shard.shard_id;
+    g_state.first_replication = msg->payload.shard.first_replication;
+  } else {
+    g_state.config = msg->payload.config;
+    g_state.first_replication = 0;
+  }
+  g_state.current_mode = g_state.config.initial_mode;
+  if (g_state.config.splitting_particles <= 0)
+    g_state.config.splitting_particles = DEFAULT_SPLITTING_PARTICLES;
 
-  send_stats_update(g_state.config.replications, g_state.config.replications,
-                    1);
+  generate_world();
+  if (g_state.role == ROLE_WORKER) {
+    g_state.seed = msg->payload.shard.seed;
+    srand(g_state.seed);
+  }
+  g_state.traj_config = 0;
+  if (g_state.role != ROLE_COORDINATOR)
+    open_trajectory_file();
 
-  Message end_msg;
-  end_msg.type = MSG_GAME_OVER;
-  snprintf(end_msg.payload.game_over_msg, sizeof(end_msg.payload.game_over_msg),
-           "Done. Results saved.");
-  send(g_state.client_socket, (char *)&end_msg, sizeof(end_msg), 0);
+  start_outbound_queue();
+  start_reporter();
+  if (g_state.role == ROLE_COORDINATOR) {
+    g_state.current_mode = MODE_SUMMARY;
+    coordinator_loop();
+  } else {
+    simulation_loop();
+  }
+  stop_reporter();
+  stop_outbound_queue();
+  close_trajectory_file();
 }
 
-int main() {
+int main(int argc, char **argv) {
   init_sockets();
   init_server();
 
-  SOCKET server_fd, client_fd;
+  int port = PORT;
+  int inherited_fd = -1;
+  int shm_fd = -1;
+  const char *worker_specs = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+      port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--fd") == 0 && i + 1 < argc)
+      inherited_fd = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--shm-fd") == 0 && i + 1 < argc)
+      shm_fd = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--worker") == 0)
+      g_state.role = ROLE_WORKER;
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      g_state.role = ROLE_COORDINATOR;
+      worker_specs = argv[++i];
+    }
+  }
+
+  if (shm_fd >= 0) {
+    void *shm = mmap(NULL, sizeof(SharedStats), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, shm_fd, 0);
+    if (shm != MAP_FAILED)
+      g_state.shared_stats = (SharedStats *)shm;
+    close(shm_fd);
+  }
+
+  SOCKET server_fd = INVALID_SOCKET, client_fd;
   struct sockaddr_in address;
   int opt = 1;
   int addrlen = sizeof(address);
 
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-    perror("socket failed");
-    exit(EXIT_FAILURE);
-  }
+  if (inherited_fd >= 0) {
+    client_fd = inherited_fd;
+  } else {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+      perror("socket failed");
+      exit(EXIT_FAILURE);
+    }
 
-  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-             sizeof(opt));
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(PORT);
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
+               sizeof(opt));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
 
-  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-    perror("bind failed");
-    exit(EXIT_FAILURE);
-  }
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+      perror("bind failed");
+      exit(EXIT_FAILURE);
+    }
 
-  if (listen(server_fd, 3) < 0) {
-    perror("listen");
-    exit(EXIT_FAILURE);
-  }
+    if (listen(server_fd, 3) < 0) {
+      perror("listen");
+      exit(EXIT_FAILURE);
+    }
 
-  printf("Server listening...\n");
-  if ((client_fd = accept(server_fd, (struct sockaddr *)&address,
-                          (socklen_t *)&addrlen)) < 0) {
-    perror("accept");
-    exit(EXIT_FAILURE);
+    printf("Server listening...\n");
+    if ((client_fd = accept(server_fd, (struct sockaddr *)&address,
+                            (socklen_t *)&addrlen)) < 0) {
+      perror("accept");
+      exit(EXIT_FAILURE);
+    }
   }
   g_state.client_socket = client_fd;
 
-  Message msg;
-  int read_size = recv(client_fd, (char *)&msg, sizeof(msg), 0);
-  if (read_size > 0 && msg.type == MSG_CONFIG) {
-    g_state.config = msg.payload.config;
-    g_state.current_mode = msg.payload.config.initial_mode;
-    generate_world();
-    simulation_loop();
+  static Message msg;
+  int read_size = recv(client_fd, (char *)&msg, sizeof(msg), MSG_WAITALL);
+  if (read_size > 0 && g_state.role == ROLE_WORKER && msg.type == MSG_SHARD) {
+    run_session(&msg);
+  } else if (read_size > 0 && msg.type == MSG_CONFIG) {
+    if (g_state.role == ROLE_COORDINATOR) {
+      g_state.config = msg.payload.config;
+      if (connect_workers(worker_specs) == -1)
+        g_state.role = ROLE_STANDALONE;
+    }
+    run_session(&msg);
   }
 
   cleanup_server();
   CLOSE_SOCKET(client_fd);
-  CLOSE_SOCKET(server_fd);
+  if (server_fd != INVALID_SOCKET)
+    CLOSE_SOCKET(server_fd);
+  if (g_state.shared_stats)
+    munmap(g_state.shared_stats, sizeof(SharedStats));
   cleanup_sockets();
   return 0;
 }